@@ -111,7 +111,8 @@ namespace HMM
 
 		void set_global_communicators ();
 		void set_repositories ();
-		void share_scale_bridging_data (ScaleBridgingData &scale_bridging_data);
+		void send_strains_to_md (ScaleBridgingData &scale_bridging_data);
+		void return_stresses_to_fe (ScaleBridgingData &scale_bridging_data);
 
 		void do_timestep ();
 
@@ -162,6 +163,7 @@ namespace HMM
 		int					stress_compute_method;
 		bool				approx_md_with_hookes_law;
 		bool				use_pjm_scheduler;
+		bool				overlap_fe_md;
 
 		double				md_timestep_length;
 		double				md_temperature;
@@ -237,6 +239,7 @@ namespace HMM
 	    stress_compute_method 	= input_config.get<int>("scale-bridging.stress computation method");
 	    approx_md_with_hookes_law	=input_config.get<bool>("scale-bridging.approximate md with hookes law");
 	    use_pjm_scheduler 	= input_config.get<bool>("scale-bridging.use pjm scheduler");
+	    overlap_fe_md 	= input_config.get<bool>("scale-bridging.overlap fe and md", false);
 
 	    // Continuum input, output, restart and log location
 		macrostatelocin	 = input_config.get<std::string>("directory structure.macroscale input");
@@ -295,6 +298,7 @@ namespace HMM
 		hcout << " - Method to compute local stresses (0 - LAMMPS, 1 - Hooke's law, 2 - ML surrogate model): "<< stress_compute_method << std::endl;
 		hcout << " - Approximate MD sims with hookes law (1 is true, 0 is false): "<< approx_md_with_hookes_law << std::endl;
 		hcout << " - Use Pilot Job Manager to schedule MD jobs: "<< use_pjm_scheduler << std::endl;
+		hcout << " - Overlap FE outputs and MD simulations on separate processes: "<< overlap_fe_md << std::endl;
 		hcout << " - FE timestep duration: "<< fe_timestep_length << std::endl;
 		hcout << " - Start timestep: "<< start_timestep << std::endl;
 		hcout << " - End timestep: "<< end_timestep << std::endl;
@@ -359,6 +363,16 @@ namespace HMM
 		//Setting up LAMMPS communicator and related variables
 		root_mmd_process = 0;
 		n_mmd_processes = n_world_processes;
+		// When overlapping FE and MD phases, MD simulations are only run by the
+		// processes that are not part of the FE communicator
+		if (overlap_fe_md){
+			if (n_world_processes <= fecores){
+				hcout << "Error: Overlapping FE and MD requires more processes than the maximum number of cores for FEM simulation." << std::endl;
+				exit(1);
+			}
+			root_mmd_process = root_fe_process + fecores;
+			n_mmd_processes = n_world_processes - fecores;
+		}
 		// Color set above 0 for processors that are going to be used
 		mmd_pcolor = MPI_UNDEFINED;
 		if (this_world_process >= root_mmd_process &&
@@ -394,24 +408,170 @@ namespace HMM
 		}
 
 		char fnset[1024]; sprintf(fnset, "%s/in.set.lammps", md_scripts_directory.c_str());
+		char fnpotential[1024]; sprintf(fnpotential, "%s/in.potential.lammps", md_scripts_directory.c_str());
 		char fnstrain[1024]; sprintf(fnstrain, "%s/in.strain.lammps", md_scripts_directory.c_str());
 		char fnelastic[1024]; sprintf(fnelastic, "%s/ELASTIC", md_scripts_directory.c_str());
 
-		if(!file_exists(fnset) || !file_exists(fnstrain) || !file_exists(fnelastic)){
+		if(!file_exists(fnset) || !file_exists(fnpotential) || !file_exists(fnstrain) || !file_exists(fnelastic)){
 			std::cerr << "Missing some MD input scripts for executing LAMMPS simulation (in 'box' directory)." << std::endl;
 			exit(1);
 		}
 	}
 
+	// The MD runs are planned once by the MD processes from a short description of the quadrature
+	// points to be updated, gathered on the root MD process. The strains are then only sent by the
+	// FE processes owning them to the roots of the batches running them, and the ids each FE process
+	// gets its stresses from go to the MD process acting as directory for them (id modulo the number
+	// of MD processes), which forwards them to the roots of the batches running the requested updates
+	template <int dim>
+	void HMMProblem<dim>::send_strains_to_md (ScaleBridgingData &scale_bridging_data)
+	{
+		int n_local_updates = scale_bridging_data.update_list.size();
+
+		std::vector<QPDescriptor> local_descriptors (n_local_updates);
+		for (int i=0; i<n_local_updates; i++){
+			const QP &qp = scale_bridging_data.update_list[i];
+			local_descriptors[i].id = qp.id;
+			local_descriptors[i].most_recent_id = qp.most_recent_id;
+			local_descriptors[i].material = qp.material;
+			local_descriptors[i].strain_norm = SymmetricTensor<2,dim>(qp.update_strain).norm();
+		}
+
+		std::vector<int> n_updates (n_world_processes, 0);
+		MPI_Gather(&n_local_updates, 1, MPI_INT, &n_updates[0], 1, MPI_INT,
+				root_mmd_process, world_communicator);
+
+		std::vector<int> update_displs (n_world_processes, 0);
+		for (int p=1; p<n_world_processes; p++) update_displs[p] = update_displs[p-1] + n_updates[p-1];
+		int n_all_updates = update_displs[n_world_processes-1] + n_updates[n_world_processes-1];
+
+		// Descriptions are received in the order of the FE processes
+		std::vector<QPDescriptor> update_descriptors (n_all_updates);
+		MPI_Gatherv(local_descriptors.data(), n_local_updates, MPI_QP_DESCRIPTOR,
+				update_descriptors.data(), &n_updates[0], &update_displs[0], MPI_QP_DESCRIPTOR,
+				root_mmd_process, world_communicator);
+		if (this_world_process == root_mmd_process)
+			scale_bridging_data.update_descriptors.swap(update_descriptors);
+
+		// Batch running each MD run, decided before any strain is sent
+		if(mmd_pcolor==0) mmd_problem->plan(timestep, present_time, newtonstep, scale_bridging_data);
+
+		// World rank of the root of the batch running each replica of the updates, returned
+		// by the root MD process to the FE process owning them
+		std::vector<int> n_runs (n_world_processes, 0);
+		std::vector<int> run_displs (n_world_processes, 0);
+		std::vector<int> run_processes;
+		if (this_world_process == root_mmd_process){
+			for (int p=0; p<n_world_processes; p++){
+				n_runs[p] = n_updates[p]*nrepl;
+				run_displs[p] = update_displs[p]*nrepl;
+			}
+			for (size_t i=0; i<scale_bridging_data.run_processes.size(); i++)
+				run_processes.push_back(root_mmd_process + scale_bridging_data.run_processes[i]);
+		}
+
+		std::vector<int> local_run_processes (n_local_updates*nrepl);
+		MPI_Scatterv(run_processes.data(), &n_runs[0], &run_displs[0], MPI_INT,
+				local_run_processes.data(), n_local_updates*nrepl, MPI_INT,
+				root_mmd_process, world_communicator);
+
+		// Each update is sent once to the root of every batch running one of its replicas
+		std::vector<std::vector<QP> > sent_updates (n_world_processes);
+		for (int i=0; i<n_local_updates; i++){
+			std::vector<int>::iterator first_run = local_run_processes.begin() + i*nrepl;
+			for (unsigned int r=0; r<nrepl; r++)
+				if (std::find(first_run, first_run+r, first_run[r]) == first_run+r)
+					sent_updates[first_run[r]].push_back(scale_bridging_data.update_list[i]);
+		}
+
+		std::vector<QP> update_list = exchange_records(sent_updates, MPI_QP, world_communicator);
+		scale_bridging_data.update_list.swap(update_list);
+
+		// Requests are sent as (id, requesting process) pairs to their directory MD process...
+		std::vector<std::vector<int> > sent_requests (n_world_processes);
+		for (size_t i=0; i<scale_bridging_data.requested_ids.size(); i++){
+			int qp_id = scale_bridging_data.requested_ids[i];
+			int p = root_mmd_process + uint32_t(qp_id)%n_mmd_processes;
+			sent_requests[p].push_back(qp_id);
+			sent_requests[p].push_back(this_world_process);
+		}
+
+		std::vector<int> requests = exchange_records(sent_requests, MPI_INT, world_communicator);
+
+		// ...which forwards them once to the root of every batch running one of the replicas
+		std::vector<std::vector<int> > forwarded_requests (n_world_processes);
+		for (size_t k=0; k<requests.size(); k+=2){
+			std::vector<int>::iterator first_run = scale_bridging_data.run_processes.begin()
+					+ scale_bridging_data.get_descriptor_position(requests[k])*nrepl;
+			for (unsigned int r=0; r<nrepl; r++)
+				if (std::find(first_run, first_run+r, first_run[r]) == first_run+r){
+					forwarded_requests[root_mmd_process + first_run[r]].push_back(requests[k]);
+					forwarded_requests[root_mmd_process + first_run[r]].push_back(requests[k+1]);
+				}
+		}
+
+		std::vector<int> routed_requests = exchange_records(forwarded_requests, MPI_INT, world_communicator);
+		for (size_t k=0; k<routed_requests.size(); k+=2){
+			scale_bridging_data.routed_ids.push_back(routed_requests[k]);
+			scale_bridging_data.routed_processes.push_back(routed_requests[k+1]);
+		}
+	}
+
+	// The roots of the batches send the contributions of their MD runs straight to the FE processes
+	// that requested them, which sum them into the stresses averaged over the replicas. Only the
+	// 6 components of the stresses are sent.
 	template <int dim>
-	void HMMProblem<dim>::share_scale_bridging_data (ScaleBridgingData &scale_bridging_data)
+	void HMMProblem<dim>::return_stresses_to_fe (ScaleBridgingData &scale_bridging_data)
 	{
-		int n_updates = scale_bridging_data.update_list.size();
-		MPI_Bcast(&n_updates , 1, MPI_INT, 0, world_communicator);
-		if (this_world_process != 0) {
-			scale_bridging_data.update_list.resize(n_updates);
+		std::vector<QPStress> &replica_stress_list = scale_bridging_data.replica_stress_list;
+		std::stable_sort(replica_stress_list.begin(), replica_stress_list.end(),
+				[](const QPStress& a, const QPStress& b){ return a.id < b.id; });
+
+		std::vector<std::vector<QPStress> > sent_stresses (n_world_processes);
+		for (size_t k=0; k<scale_bridging_data.routed_ids.size(); k++){
+			QPStress request;
+			request.id = scale_bridging_data.routed_ids[k];
+			std::pair<std::vector<QPStress>::iterator, std::vector<QPStress>::iterator> contributions =
+					std::equal_range(replica_stress_list.begin(), replica_stress_list.end(), request,
+							[](const QPStress& a, const QPStress& b){ return a.id < b.id; });
+			sent_stresses[scale_bridging_data.routed_processes[k]].insert(
+					sent_stresses[scale_bridging_data.routed_processes[k]].end(),
+					contributions.first, contributions.second);
+		}
+
+		std::vector<QPStress> replica_stresses = exchange_records(sent_stresses, MPI_QP_STRESS, world_communicator);
+
+		// Requested ids are sorted and unique, each of them gets one contribution per replica
+		const std::vector<int> &requested_ids = scale_bridging_data.requested_ids;
+		int n_local_requests = requested_ids.size();
+
+		std::vector<QPStress> &stress_list = scale_bridging_data.stress_list;
+		stress_list.resize(n_local_requests);
+		std::vector<unsigned int> n_contributions (n_local_requests, 0);
+		for (int i=0; i<n_local_requests; i++){
+			stress_list[i].id = requested_ids[i];
+			for (int j=0; j<6; j++) stress_list[i].update_stress[j] = 0.;
+		}
+
+		for (size_t k=0; k<replica_stresses.size(); k++){
+			int i = std::lower_bound(requested_ids.begin(), requested_ids.end(), replica_stresses[k].id)
+					- requested_ids.begin();
+			if (i == n_local_requests || requested_ids[i] != replica_stresses[k].id){
+				std::cerr << "Error: Stress returned for QP with id " << replica_stresses[k].id
+						<< " which was not requested" << std::endl;
+				exit(1);
+			}
+			for (int j=0; j<6; j++) stress_list[i].update_stress[j] += replica_stresses[k].update_stress[j];
+			n_contributions[i]++;
+		}
+
+		for (int i=0; i<n_local_requests; i++){
+			if (n_contributions[i] != nrepl){
+				std::cerr << "Error: " << n_contributions[i] << " replicas out of " << nrepl
+						<< " returned a stress for QP with id " << requested_ids[i] << std::endl;
+				exit(1);
+			}
 		}
-		MPI_Bcast(&(scale_bridging_data.update_list[0]), n_updates, MPI_QP, 0, world_communicator);
 	}
 
 	template <int dim>
@@ -448,14 +608,20 @@ namespace HMM
 			ScaleBridgingData scale_bridging_data;	
 			if(fe_pcolor==0) fe_problem->solve(newtonstep, scale_bridging_data);
 
-			share_scale_bridging_data(scale_bridging_data);
+			send_strains_to_md(scale_bridging_data);
 
 			//hcout << "ENTERING HELL" << std::endl;
 
-			if(mmd_pcolor==0) mmd_problem->update(timestep, present_time, newtonstep, scale_bridging_data);
-			MPI_Barrier(world_communicator);
+			if(mmd_pcolor==0) mmd_problem->update(scale_bridging_data);
+
+			// FE processes write the outputs of the previous timestep while the MD simulations
+			// are running, then wait for the stresses to be sent back
+			if(overlap_fe_md){
+				if(fe_pcolor==0) fe_problem->flush_outputs();
+			}
+			else MPI_Barrier(world_communicator);
 			
-			share_scale_bridging_data(scale_bridging_data);
+			return_stresses_to_fe(scale_bridging_data);
 
 			if(fe_pcolor==0) continue_newton = fe_problem->check(scale_bridging_data);
 
@@ -464,7 +630,7 @@ namespace HMM
 
 		} while (continue_newton);
 
-		if(fe_pcolor==0) fe_problem->endstep();
+		if(fe_pcolor==0) fe_problem->endstep(overlap_fe_md);
 		
 		MPI_Barrier(world_communicator);
 
@@ -531,6 +697,9 @@ namespace HMM
 		while (present_time < end_time){
 			do_timestep();
 		}
+
+		// Outputs of the last timestep have been deferred
+		if(fe_pcolor==0) fe_problem->flush_outputs();
 		
 		if(mmd_pcolor==0) delete mmd_problem;
 		if(fe_pcolor==0) delete fe_problem;
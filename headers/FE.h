@@ -24,6 +24,9 @@
 #include "read_write.h"
 #include "math_calc.h"
 #include "scale_bridging_data.h"
+#include "mpi_checkpoint.h"
+#include "qp_timeseries.h"
+#include "visualisation_writer.h"
 
 // Reduction model based on spline comparison
 #include "strain2spline.h"
@@ -76,33 +79,166 @@
 #include <deal.II/base/symmetric_tensor.h>
 #include <deal.II/grid/filtered_iterator.h>
 #include <deal.II/base/mpi.h>
+#include <deal.II/base/work_stream.h>
+#include <deal.II/base/parallel.h>
 
 namespace HMM
 {
 	using namespace dealii;
 
+	// Quadrature point data of the cells owned by this FE process, stored as one
+	// contiguous array per field. The quadrature points of a cell are stored next
+	// to each other, starting at index cell_range_begin(cell).
 	template <int dim>
-	struct PointHistory
+	class QuadraturePointStore
 	{
+	public:
+		void reinit (const Triangulation<dim> &triangulation, const unsigned int n_q_points)
+		{
+			n_q_points_per_cell = n_q_points;
+
+			first_qp_of_cell.assign(triangulation.n_active_cells(), numbers::invalid_unsigned_int);
+			unsigned int n_local_qps = 0;
+			for (typename Triangulation<dim>::active_cell_iterator
+					cell = triangulation.begin_active();
+					cell != triangulation.end(); ++cell)
+				if (cell->is_locally_owned())
+				{
+					first_qp_of_cell[cell->active_cell_index()] = n_local_qps;
+					n_local_qps += n_q_points_per_cell;
+				}
+
+			old_stress.assign(n_local_qps, SymmetricTensor<2,dim>());
+			new_stress.assign(n_local_qps, SymmetricTensor<2,dim>());
+			old_strain.assign(n_local_qps, SymmetricTensor<2,dim>());
+			new_strain.assign(n_local_qps, SymmetricTensor<2,dim>());
+			upd_strain.assign(n_local_qps, SymmetricTensor<2,dim>());
+			newton_strain.assign(n_local_qps, SymmetricTensor<2,dim>());
+			hist_strain.assign(n_local_qps, MatHistPredict::Strain6D());
+			to_be_updated_with_md.assign(n_local_qps, false);
+
+			qpid.assign(n_local_qps, 0);
+			material.assign(n_local_qps, 0);
+			stiffness_index.assign(n_local_qps, 0);
+			rotam.assign(n_local_qps/n_q_points_per_cell, Tensor<2,dim>());
+		}
+
+		unsigned int size () const
+		{
+			return qpid.size();
+		}
+
+		// Index of the first quadrature point of a locally owned cell
+		template <class CellIterator>
+		unsigned int cell_range_begin (const CellIterator &cell) const
+		{
+			Assert (first_qp_of_cell[cell->active_cell_index()] != numbers::invalid_unsigned_int,
+					ExcInternalError());
+			return first_qp_of_cell[cell->active_cell_index()];
+		}
+
+		const SymmetricTensor<4,dim> &stiffness (const unsigned int k) const
+		{
+			return stiffnesses[stiffness_index[k]];
+		}
+
+		const Tensor<2,dim> &rotation (const unsigned int k) const
+		{
+			return rotam[k/n_q_points_per_cell];
+		}
+
+		double density (const unsigned int k) const
+		{
+			return material_densities[material[k]];
+		}
+
+		// Only the fields written to the outputs are swapped, see FEProblem::flush_outputs
+		void swap_output_fields (QuadraturePointStore<dim> &other)
+		{
+			new_strain.swap(other.new_strain);
+			upd_strain.swap(other.upd_strain);
+			new_stress.swap(other.new_stress);
+		}
+
+		void copy_output_fields (const QuadraturePointStore<dim> &other)
+		{
+			new_strain = other.new_strain;
+			upd_strain = other.upd_strain;
+			new_stress = other.new_stress;
+		}
+
 		// History
-		SymmetricTensor<2,dim> old_stress;
-		SymmetricTensor<2,dim> new_stress;
-		SymmetricTensor<2,dim> inc_stress;
-		SymmetricTensor<4,dim> old_stiff;
-		SymmetricTensor<4,dim> new_stiff;
-		SymmetricTensor<2,dim> old_strain;
-		SymmetricTensor<2,dim> new_strain;
-		SymmetricTensor<2,dim> inc_strain;
-		SymmetricTensor<2,dim> upd_strain;
-		SymmetricTensor<2,dim> newton_strain;
-		MatHistPredict::Strain6D hist_strain;
-		bool to_be_updated_with_md;
+		std::vector<SymmetricTensor<2,dim> > 	old_stress;
+		std::vector<SymmetricTensor<2,dim> > 	new_stress;
+		std::vector<SymmetricTensor<2,dim> > 	old_strain;
+		std::vector<SymmetricTensor<2,dim> > 	new_strain;
+		std::vector<SymmetricTensor<2,dim> > 	upd_strain;
+		std::vector<SymmetricTensor<2,dim> > 	newton_strain;
+		std::vector<MatHistPredict::Strain6D> 	hist_strain;
+		std::vector<unsigned char> 				to_be_updated_with_md;
 
 		// Characteristics
-		unsigned int qpid;
-		double rho;
-		std::string mat;
-		Tensor<2,dim> rotam;
+		std::vector<unsigned int> 				qpid;
+		std::vector<unsigned char> 				material; // index in the list of md types
+		std::vector<unsigned int> 				stiffness_index;
+
+		// Shared characteristics: stiffnesses (one per material, or per material and cell
+		// orientation), densities per material and rotations per cell
+		std::vector<SymmetricTensor<4,dim> > 	stiffnesses;
+		std::vector<double> 					material_densities;
+		std::vector<Tensor<2,dim> > 			rotam;
+
+	private:
+		unsigned int 							n_q_points_per_cell;
+		std::vector<unsigned int> 				first_qp_of_cell;
+	};
+
+
+
+	// Iterator over the cells owned by this FE process, for the thread-parallel cell loops
+	template <int dim>
+	using LocallyOwnedCellIterator = FilteredIterator<typename DoFHandler<dim>::active_cell_iterator>;
+
+	// Scratch data of the thread-parallel cell loops (one copy per thread)
+	template <int dim>
+	struct CellScratchData
+	{
+		CellScratchData (const FiniteElement<dim> &fe, const Quadrature<dim> &quadrature,
+				const UpdateFlags update_flags)
+		:
+			fe_values (fe, quadrature, update_flags),
+			displacement_update_grads (quadrature.size(), std::vector<Tensor<1,dim> >(dim)),
+			body_force_values (quadrature.size(), Vector<double>(dim))
+		{}
+
+		CellScratchData (const CellScratchData &scratch)
+		:
+			fe_values (scratch.fe_values.get_fe(), scratch.fe_values.get_quadrature(),
+					scratch.fe_values.get_update_flags()),
+			displacement_update_grads (scratch.displacement_update_grads),
+			body_force_values (scratch.body_force_values)
+		{}
+
+		FEValues<dim> 								fe_values;
+		std::vector<std::vector<Tensor<1,dim> > > 	displacement_update_grads;
+		std::vector<Vector<double> > 				body_force_values;
+	};
+
+	// Local contributions of a cell, copied to the global objects by one thread at a time
+	struct CellCopyData
+	{
+		CellCopyData (const unsigned int dofs_per_cell)
+		:
+			cell_matrix (dofs_per_cell, dofs_per_cell),
+			cell_vector (dofs_per_cell),
+			cell_internal_forces (dofs_per_cell),
+			local_dof_indices (dofs_per_cell)
+		{}
+
+		FullMatrix<double> 						cell_matrix;
+		Vector<double> 							cell_vector;
+		Vector<double> 							cell_internal_forces;
+		std::vector<types::global_dof_index> 	local_dof_indices;
 	};
 
 
@@ -238,8 +374,9 @@ namespace HMM
 											boost::property_tree::ptree inconfig, bool hookeslaw);
 							void beginstep (int tstp, double ptime);
 							void solve (int nstp, ScaleBridgingData &scale_bridging_data);
-							bool check (ScaleBridgingData scale_bridging_data);
-							void endstep ();
+							bool check (ScaleBridgingData &scale_bridging_data);
+							void endstep (bool defer_outputs);
+							void flush_outputs ();
 
 					private:
 							void make_grid ();
@@ -249,7 +386,7 @@ namespace HMM
 							std::vector<Vector<double> > generate_microstructure_uniform();
 							void assign_microstructure (typename DoFHandler<dim>::active_cell_iterator cell, 
 											CellData<dim> celldata,
-											std::string &mat, Tensor<2,dim> &rotam);
+											unsigned char &mat, Tensor<2,dim> &rotam);
 							void setup_quadrature_point_history ();
 							void restart ();
 
@@ -260,26 +397,26 @@ namespace HMM
 							void solve_linear_problem_GMRES ();
 							void solve_linear_problem_BiCGStab ();
 							void solve_linear_problem_direct ();
+							void solve_lumped_mass ();
 							void update_incremental_variables ();
 							void update_strain_quadrature_point_history
 									(const Vector<double>& displacement_update);
-							void check_strain_quadrature_point_history();
-							void spline_building();
 							void spline_comparison();
 							void history_analysis();
 							void write_md_updates_list(ScaleBridgingData &scale_bridging_data);
 
-							void gather_qp_update_list(ScaleBridgingData &scale_bridging_data);
 							template <typename T>
 							std::vector<T> gather_vector(std::vector<T> local_vector);
 							SymmetricTensor<2,dim> compute_stress_with_surrogate(SymmetricTensor<2,dim> old_strain,
 																				 SymmetricTensor<2,dim> new_strain,
 																				 SymmetricTensor<2,dim> old_stress);
 							void update_stress_quadrature_point_history
-									(const Vector<double>& displacement_update, ScaleBridgingData scale_bridging_data);
+									(const ScaleBridgingData &scale_bridging_data);
 							void clean_transfer();
 
-							Vector<double>  compute_internal_forces () const;
+							void add_cell_internal_forces (const FEValues<dim> &fe_values,
+											const unsigned int first_qp,
+											const double factor, Vector<double> &cell_vector) const;
 							std::vector< std::vector< Vector<double> > >
 									compute_history_projection_from_qp_to_nodes (FE_DGQ<dim> &history_fe, DoFHandler<dim> &history_dof_handler, std::string stensor) const;
 							void output_lbc_force ();
@@ -288,6 +425,7 @@ namespace HMM
 							void output_visualisation_history ();
 							void output_results ();
 							void checkpoint () const;
+							void write_outputs ();
 
 							Vector<double> 		     			newton_update_displacement;
 							Vector<double> 		     			incremental_displacement;
@@ -324,13 +462,37 @@ namespace HMM
 							DoFHandler<dim> 					history_dof_handler;
 
 							ConstraintMatrix     				hanging_node_constraints;
-							std::vector<PointHistory<dim> > 	quadrature_point_history;
+							QuadraturePointStore<dim> 			quadrature_point_history;
+
+							// Quadrature points flagged for an MD update during the last strain update
+							// (index in quadrature_point_history), in cell order
+							std::vector<unsigned int>			md_update_candidates;
+
+							// Converged state of the last timestep, kept until its outputs are written
+							bool								pending_outputs = false;
+							QuadraturePointStore<dim> 			output_quadrature_point_history;
+							int									output_timestep;
+							double								output_present_time;
+
+							// Visualisation files being formatted in the background, declared after the
+							// dof handlers its snapshots refer to
+							AsyncVTUWriter<dim>					visualisation_writer;
 
 							PETScWrappers::MPI::SparseMatrix	system_matrix;
 							PETScWrappers::MPI::SparseMatrix	mass_matrix;
 							//		PETScWrappers::MPI::SparseMatrix	system_inverse;
 							PETScWrappers::MPI::Vector      	system_rhs;
 
+							// Internal forces of the last assembly (i.e. of the converged state at the
+							// end of a timestep), and their snapshot kept until the outputs are written
+							PETScWrappers::MPI::Vector      	internal_forces;
+							PETScWrappers::MPI::Vector      	output_internal_forces;
+
+							// Diagonal of the lumped mass matrix, replacing the mass and system matrices
+							// when the velocity update is computed without the linear solver
+							bool								use_lumped_mass;
+							PETScWrappers::MPI::Vector      	lumped_mass;
+
 							std::vector<types::global_dof_index> local_dofs_per_process;
 							IndexSet 							locally_owned_dofs;
 							IndexSet 							locally_relevant_dofs;
@@ -351,7 +513,6 @@ namespace HMM
 							int 								num_spline_points;
 							int 								min_num_steps_before_spline;
 							double								acceptable_diff_threshold;
-							std::string							clusteringscriptsloc;
 
 							std::string                         macrostatelocin;
 							std::string                         macrostatelocout;
@@ -114,6 +114,7 @@ namespace HMM
 	template <int dim>
 			FEProblem<dim>::~FEProblem ()
 			{
+					visualisation_writer.flush ();
 					dof_handler.clear ();
 			}
 
@@ -200,23 +201,30 @@ namespace HMM
 									hanging_node_constraints);
 					hanging_node_constraints.close ();
 
-					DynamicSparsityPattern sparsity_pattern (locally_relevant_dofs);
-					DoFTools::make_sparsity_pattern (dof_handler, sparsity_pattern,
-									hanging_node_constraints, false);
-					SparsityTools::distribute_sparsity_pattern (sparsity_pattern,
-									local_dofs_per_process,
-									FE_communicator,
-									locally_relevant_dofs);
-
-					mass_matrix.reinit (locally_owned_dofs,
-									locally_owned_dofs,
-									sparsity_pattern,
-									FE_communicator);
-					system_matrix.reinit (locally_owned_dofs,
-									locally_owned_dofs,
-									sparsity_pattern,
-									FE_communicator);
+					if (use_lumped_mass){
+							lumped_mass.reinit (locally_owned_dofs, FE_communicator);
+					}
+					else{
+							DynamicSparsityPattern sparsity_pattern (locally_relevant_dofs);
+							DoFTools::make_sparsity_pattern (dof_handler, sparsity_pattern,
+											hanging_node_constraints, false);
+							SparsityTools::distribute_sparsity_pattern (sparsity_pattern,
+											local_dofs_per_process,
+											FE_communicator,
+											locally_relevant_dofs);
+
+							mass_matrix.reinit (locally_owned_dofs,
+											locally_owned_dofs,
+											sparsity_pattern,
+											FE_communicator);
+							system_matrix.reinit (locally_owned_dofs,
+											locally_owned_dofs,
+											sparsity_pattern,
+											FE_communicator);
+					}
 					system_rhs.reinit (locally_owned_dofs, FE_communicator);
+					internal_forces.reinit (locally_owned_dofs, FE_communicator);
+					output_internal_forces.reinit (locally_owned_dofs, FE_communicator);
 
 					newton_update_displacement.reinit (dof_handler.n_dofs());
 					incremental_displacement.reinit (dof_handler.n_dofs());
@@ -345,7 +353,7 @@ namespace HMM
 
 	template <int dim>
 			void FEProblem<dim>::assign_microstructure (typename DoFHandler<dim>::active_cell_iterator cell, CellData<dim> celldata,
-							std::string &mat, Tensor<2,dim> &rotam)
+							unsigned char &mat, Tensor<2,dim> &rotam)
 			{
 
 					// Filling identity matrix
@@ -356,7 +364,7 @@ namespace HMM
 					rotam = idmat;
 
 					unsigned int n = cell->active_cell_index();
-					mat = mdtype[ celldata.get_composition(n) ];	
+					mat = celldata.get_composition(n);
 					//std::cout << n << " " << mat <<" "<<celldata.get_composition(n)<< std::endl;
 
 					/*
@@ -390,13 +398,12 @@ namespace HMM
 			template <int dim>
 					void FEProblem<dim>::setup_quadrature_point_history ()
 					{
-							triangulation.clear_user_data();
-							{
-									std::vector<PointHistory<dim> > tmp;
-									tmp.swap (quadrature_point_history);
-							}
-							quadrature_point_history.resize (n_local_cells *
-											quadrature_formula.size());
+							// Setting up distributed quadrature point local history
+							quadrature_point_history.reinit (triangulation, quadrature_formula.size());
+							md_update_candidates.clear();
+
+							Assert (quadrature_point_history.size() == n_local_cells*quadrature_formula.size(),
+											ExcInternalError());
 							char filename[1024];
 
 							// Set materials initial stiffness tensors
@@ -436,19 +443,16 @@ namespace HMM
 
 							}
 
-							// Setting up distributed quadrature point local history
-							unsigned int history_index = 0;
-							for (typename Triangulation<dim>::active_cell_iterator
-											cell = triangulation.begin_active();
-											cell != triangulation.end(); ++cell)
-									if (cell->is_locally_owned())
-									{
-											cell->set_user_pointer (&quadrature_point_history[history_index]);
-											history_index += quadrature_formula.size();
-									}
+							// Quadrature points refer to the stiffness and density of their material
+							quadrature_point_history.stiffnesses = stiffness_tensors;
+							quadrature_point_history.material_densities = densities;
 
-							Assert (history_index == quadrature_point_history.size(),
-											ExcInternalError());
+							Tensor<2,dim> idmat;
+							idmat = 0.0; for (unsigned int i=0; i<dim; ++i) idmat[i][i] = 1.0;
+
+							// Maximum number of strain states kept in the history of each quadrature point
+							const unsigned int max_history_points =
+											input_config.get<unsigned int>("model precision.clustering.max history points", 0);
 
 							// Create file with mdtype of qptid to update at timeid
 							std::ofstream omatfile;
@@ -467,49 +471,42 @@ namespace HMM
 											cell != dof_handler.end(); ++cell)
 									if (cell->is_locally_owned())
 									{
-											PointHistory<dim> *local_quadrature_points_history
-													= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-											Assert (local_quadrature_points_history >=
-															&quadrature_point_history.front(),
-															ExcInternalError());
-											Assert (local_quadrature_points_history <
-															&quadrature_point_history.back(),
-															ExcInternalError());
+											const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
+
+											// Assign microstructure to the current cell (so far, mdtype
+											// and rotation from global to common ground direction)
+											unsigned char mat;
+											Tensor<2,dim> &rotam = quadrature_point_history.rotam[first_qp/quadrature_formula.size()];
+											assign_microstructure(cell, celldata, mat, rotam);
+
+											// Apply stiffness and rotating it from the local sheet orientation (MD) to
+											// global orientation (microstructure), the rotated stiffness being only
+											// stored separately for cells which are not aligned with the MD orientation
+											unsigned int stiffness_index = mat;
+											if (rotam != idmat){
+													stiffness_index = quadrature_point_history.stiffnesses.size();
+													quadrature_point_history.stiffnesses.push_back(
+																	rotate_tensor(stiffness_tensors[mat], transpose(rotam)));
+											}
 
 											for (unsigned int q=0; q<quadrature_formula.size(); ++q)
 											{
-													local_quadrature_points_history[q].new_strain = 0;
-													local_quadrature_points_history[q].upd_strain = 0;
-													local_quadrature_points_history[q].to_be_updated_with_md = false;
-													local_quadrature_points_history[q].new_stress = 0;
-													local_quadrature_points_history[q].qpid = cell->active_cell_index()*quadrature_formula.size() + q;
+													const unsigned int k = first_qp + q;
 
-													// Tell strain history object what cell ID it belongs to
-													local_quadrature_points_history[q].hist_strain.set_ID(local_quadrature_points_history[q].qpid);
+													quadrature_point_history.new_strain[k] = 0;
+													quadrature_point_history.upd_strain[k] = 0;
+													quadrature_point_history.to_be_updated_with_md[k] = false;
+													quadrature_point_history.new_stress[k] = 0;
+													quadrature_point_history.qpid[k] = cell->active_cell_index()*quadrature_formula.size() + q;
 
-													// Assign microstructure to the current cell (so far, mdtype
-													// and rotation from global to common ground direction)
+													// Tell strain history object what cell ID it belongs to
+													quadrature_point_history.hist_strain[k].set_ID(quadrature_point_history.qpid[k]);
+													quadrature_point_history.hist_strain[k].set_max_history_length(max_history_points);
 
-													if (q==0) assign_microstructure(cell, celldata,
-																	local_quadrature_points_history[q].mat,
-																	local_quadrature_points_history[q].rotam);
-													else{
-															local_quadrature_points_history[q].mat = local_quadrature_points_history[0].mat;
-															local_quadrature_points_history[q].rotam = local_quadrature_points_history[0].rotam;
-													}
+													quadrature_point_history.material[k] = mat;
+													quadrature_point_history.stiffness_index[k] = stiffness_index;
 
-													// Apply stiffness and rotating it from the local sheet orientation (MD) to
-													// global orientation (microstructure)
-													for (int imd = 0; imd<int(mdtype.size()); imd++)
-															if(local_quadrature_points_history[q].mat==mdtype[imd]){
-																	local_quadrature_points_history[q].new_stiff =
-																			rotate_tensor(stiffness_tensors[imd],
-																							transpose(local_quadrature_points_history[q].rotam));
-
-																	// Apply composite density (by averaging over replicas of given material)
-																	local_quadrature_points_history[q].rho = densities[imd];
-															}
-													omatfile << local_quadrature_points_history[q].qpid << " " << local_quadrature_points_history[q].mat << std::endl;
+													omatfile << quadrature_point_history.qpid[k] << " " << mdtype[mat] << std::endl;
 											}
 									}
 
@@ -545,13 +542,10 @@ namespace HMM
 							// Recovery of the solution vector containing total displacements in the
 							// previous simulation and computing the total strain from it.
 							sprintf(filename, "%s/restart/lcts.solution.bin", macrostatelocin.c_str());
-							std::ifstream ifile(filename);
-							if (ifile.is_open())
+							dcout << "    ...recovery of the position vector... " << std::flush;
+							if (read_checkpoint_vector(filename, displacement.begin(), displacement.size(), FE_communicator))
 							{
-									dcout << "    ...recovery of the position vector... " << std::flush;
-									displacement.block_read(ifile);
 									dcout << "    solution norm: " << displacement.l2_norm() << std::endl;
-									ifile.close();
 
 									dcout << "    ...computation of total strains from the recovered position vector. " << std::endl;
 									FEValues<dim> fe_values (fe, quadrature_formula,
@@ -565,14 +559,7 @@ namespace HMM
 													cell != dof_handler.end(); ++cell)
 											if (cell->is_locally_owned())
 											{
-													PointHistory<dim> *local_quadrature_points_history
-															= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-													Assert (local_quadrature_points_history >=
-																	&quadrature_point_history.front(),
-																	ExcInternalError());
-													Assert (local_quadrature_points_history <
-																	&quadrature_point_history.back(),
-																	ExcInternalError());
+													const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
 													fe_values.reinit (cell);
 													fe_values.get_function_gradients (displacement,
 																	solution_grads);
@@ -580,7 +567,7 @@ namespace HMM
 													for (unsigned int q=0; q<quadrature_formula.size(); ++q)
 													{
 															// Strain tensor update
-															local_quadrature_points_history[q].new_strain =
+															quadrature_point_history.new_strain[first_qp+q] =
 																	get_strain (solution_grads[q]);
 
 															// Only needed if the mesh is modified after every timestep...
@@ -599,112 +586,40 @@ namespace HMM
 											}
 							}
 							else{
-									dcout << "    No file to load/restart displacements from." << std::endl;
+									dcout << std::endl << "    No file to load/restart displacements from." << std::endl;
 							}
 
 							// Recovery of the velocity vector
 							sprintf(filename, "%s/restart/lcts.velocity.bin", macrostatelocin.c_str());
-							std::ifstream ifile_veloc(filename);
-							if (ifile_veloc.is_open())
+							dcout << "    ...recovery of the velocity vector... " << std::flush;
+							if (read_checkpoint_vector(filename, velocity.begin(), velocity.size(), FE_communicator))
 							{
-									dcout << "    ...recovery of the velocity vector... " << std::flush;
-									velocity.block_read(ifile_veloc);
 									dcout << "    velocity norm: " << velocity.l2_norm() << std::endl;
-									ifile_veloc.close();
 							}
 							else{
-									dcout << "    No file to load/restart velocities from." << std::endl;
+									dcout << std::endl << "    No file to load/restart velocities from." << std::endl;
 							}
 
-							// Opening processor local history file
-							sprintf(filename, "%s/restart/lcts.pr_%d.lhistory.bin", macrostatelocin.c_str(), this_FE_process);
-							std::ifstream  lhprocin(filename, std::ios_base::binary);
-
-							// If openend, restore local data history...
-							int ncell_lhistory=0;
-							if (lhprocin.good()){
-									std::string line;
-									// Compute number of cells in local history ()
-									while(getline(lhprocin, line)){
-											//nline_lhistory++;
-											// Extract values...
-											std::istringstream sline(line);
-											std::string var;
-											int item_count = 0;
-											int cell = 0;
-											while(getline(sline, var, ',' )){
-													if(item_count==1) cell = std::stoi(var);
-													item_count++;
-											}
-											ncell_lhistory = std::max(ncell_lhistory, cell);
-									}
-									//int ncell_lhistory = n_FE_processes*nline_lhistory/quadrature_formula.size();
-									//std::cout << "proc: " << this_FE_process << " ncell history: " << ncell_lhistory << std::endl;
-
-									// Create structure to store retrieve data as matrix[cell][qpoint]
-									std::vector<std::vector<PointHistory<dim>> > proc_lhistory (ncell_lhistory+1,
-													std::vector<PointHistory<dim> >(quadrature_formula.size()));
-
-									MPI_Barrier(FE_communicator);
-
-									// Read and insert data
-									lhprocin.clear();
-									lhprocin.seekg(0, std::ios_base::beg);
-									while(getline(lhprocin, line)){
-											// Extract values...
-											std::istringstream sline(line);
-											std::string var;
-											int item_count = 0;
-											int cell = 0;
-											int qpoint = 0;
-											while(getline(sline, var, ',' )){
-													if(item_count==1) cell = std::stoi(var);
-													else if(item_count==2) qpoint = std::stoi(var);
-													else if(item_count==4) proc_lhistory[cell][qpoint].upd_strain[0][0] = std::stod(var);
-													else if(item_count==5) proc_lhistory[cell][qpoint].upd_strain[0][1] = std::stod(var);
-													else if(item_count==6) proc_lhistory[cell][qpoint].upd_strain[0][2] = std::stod(var);
-													else if(item_count==7) proc_lhistory[cell][qpoint].upd_strain[1][1] = std::stod(var);
-													else if(item_count==8) proc_lhistory[cell][qpoint].upd_strain[1][2] = std::stod(var);
-													else if(item_count==9) proc_lhistory[cell][qpoint].upd_strain[2][2] = std::stod(var);
-													else if(item_count==10) proc_lhistory[cell][qpoint].new_stress[0][0] = std::stod(var);
-													else if(item_count==11) proc_lhistory[cell][qpoint].new_stress[0][1] = std::stod(var);
-													else if(item_count==12) proc_lhistory[cell][qpoint].new_stress[0][2] = std::stod(var);
-													else if(item_count==13) proc_lhistory[cell][qpoint].new_stress[1][1] = std::stod(var);
-													else if(item_count==14) proc_lhistory[cell][qpoint].new_stress[1][2] = std::stod(var);
-													else if(item_count==15) proc_lhistory[cell][qpoint].new_stress[2][2] = std::stod(var);
-													item_count++;
-											}
-											//				if(cell%90 == 0) std::cout << cell<<","<<qpoint<<","<<proc_lhistory[cell][qpoint].upd_strain[0][0]
-											//				    <<","<<proc_lhistory[cell][qpoint].new_stress[0][0] << std::endl;
-									}
-
-									MPI_Barrier(FE_communicator);
-
-									// Need to verify that the recovery of the local history is performed correctly...
+							// Restoring the local data history from the records of the quadrature points owned
+							// by this processor, whatever the number of processors that wrote them
+							const unsigned int n_components = SymmetricTensor<2,dim>::n_independent_components;
+							std::vector<double> lhistory;
+							std::vector<int64_t> qpids (quadrature_point_history.size());
+							for (unsigned int k=0; k<quadrature_point_history.size(); ++k)
+									qpids[k] = quadrature_point_history.qpid[k];
+
+							sprintf(filename, "%s/restart/lcts.lhistory.bin", macrostatelocin.c_str());
+							if (read_checkpoint_records(filename, lhistory, 2*n_components, qpids,
+											int64_t(triangulation.n_active_cells())*quadrature_formula.size(), FE_communicator)){
 									dcout << "    ...recovery of the quadrature point history. " << std::endl;
-									for (typename DoFHandler<dim>::active_cell_iterator
-													cell = dof_handler.begin_active();
-													cell != dof_handler.end(); ++cell)
-											if (cell->is_locally_owned())
-											{
-													PointHistory<dim> *local_quadrature_points_history
-															= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-													Assert (local_quadrature_points_history >=
-																	&quadrature_point_history.front(),
-																	ExcInternalError());
-													Assert (local_quadrature_points_history <
-																	&quadrature_point_history.back(),
-																	ExcInternalError());
-
-													for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-													{
-															//std::cout << "proc: " << this_FE_process << " cell: " << cell->active_cell_index() << " qpoint: " << q << std::endl;
-															// Assigning update strain and stress tensor
-															local_quadrature_points_history[q].upd_strain=proc_lhistory[cell->active_cell_index()][q].upd_strain;
-															local_quadrature_points_history[q].new_stress=proc_lhistory[cell->active_cell_index()][q].new_stress;
-													}
+									for (unsigned int k=0; k<quadrature_point_history.size(); ++k)
+									{
+											const double *record = &lhistory[k*2*n_components];
+											for (unsigned int i=0; i<n_components; ++i){
+													quadrature_point_history.upd_strain[k].access_raw_entry(i) = record[i];
+													quadrature_point_history.new_stress[k].access_raw_entry(i) = record[n_components+i];
 											}
-									lhprocin.close();
+									}
 							}
 							else{
 									dcout << "    No file to load/restart local histories from." << std::endl;
@@ -734,44 +649,40 @@ namespace HMM
 					{
 							double rhs_residual;
 
-							typename DoFHandler<dim>::active_cell_iterator
-									cell = dof_handler.begin_active(),
-										 endc = dof_handler.end();
-
-							FEValues<dim> fe_values (fe, quadrature_formula,
-											update_values   | update_gradients |
-											update_quadrature_points | update_JxW_values);
-
 							const unsigned int   dofs_per_cell = fe.dofs_per_cell;
 							const unsigned int   n_q_points    = quadrature_formula.size();
 
-							FullMatrix<double>   cell_mass (dofs_per_cell, dofs_per_cell);
-							Vector<double>       cell_force (dofs_per_cell);
-
-							FullMatrix<double>   cell_v_matrix (dofs_per_cell, dofs_per_cell);
-							Vector<double>       cell_v_rhs (dofs_per_cell);
-
-							std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
 		BodyForce<dim>      body_force;
-		std::vector<Vector<double> > body_force_values (n_q_points,
-				Vector<double>(dim));
 
 		system_rhs = 0;
-		system_matrix = 0;
+		internal_forces = 0;
+		if (use_lumped_mass){
+			if(first_assemble) lumped_mass = 0;
+		}
+		else system_matrix = 0;
 
-		for (; cell!=endc; ++cell)
-			if (cell->is_locally_owned())
+		// Local matrices and rhs are computed by all threads, and assembled by one thread at a time
+		CellScratchData<dim> sample_scratch (fe, quadrature_formula,
+				update_values   | update_gradients |
+				update_quadrature_points | update_JxW_values);
+		CellCopyData sample_copy (dofs_per_cell);
+
+		WorkStream::run (LocallyOwnedCellIterator<dim>(IteratorFilters::LocallyOwnedCell(), dof_handler.begin_active()),
+				LocallyOwnedCellIterator<dim>(IteratorFilters::LocallyOwnedCell(), dof_handler.end()),
+				[&] (const LocallyOwnedCellIterator<dim> &cell, CellScratchData<dim> &scratch, CellCopyData &copy)
 			{
-				cell_mass = 0;
-				cell_force = 0;
+				FEValues<dim> &fe_values = scratch.fe_values;
+				FullMatrix<double> &cell_mass = copy.cell_matrix;
+				Vector<double> &cell_v_rhs = copy.cell_vector;
+
+				Vector<double>       cell_force (dofs_per_cell);
 
-				cell_v_matrix = 0;
+				cell_mass = 0;
 				cell_v_rhs = 0;
 
 				fe_values.reinit (cell);
 
-				const PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim>*>(cell->user_pointer());
+				const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
 
 				// Assembly of mass matrix
 				if(first_assemble)
@@ -781,7 +692,7 @@ namespace HMM
 									++q_point)
 							{
 								const double rho =
-										local_quadrature_points_history[q_point].rho;
+										quadrature_point_history.density(first_qp+q_point);
 
 								const double
 								phi_i = fe_values.shape_value (i,q_point),
@@ -800,59 +711,73 @@ namespace HMM
 							}
 
 				// Assembly of external forces vector
-				for (unsigned int i=0; i<dofs_per_cell; ++i)
+				body_force.vector_value_list (fe_values.get_quadrature_points(),
+						scratch.body_force_values);
+
+				for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
 				{
-					const unsigned int
-					component_i = fe.system_to_component_index(i).first;
+					const double rho_JxW = quadrature_point_history.density(first_qp+q_point)
+							* fe_values.JxW (q_point);
 
-					for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-					{
-						body_force.vector_value_list (fe_values.get_quadrature_points(),
-								body_force_values);
-
-						const SymmetricTensor<2,dim> &new_stress
-						= local_quadrature_points_history[q_point].new_stress;
-
-						// how to handle body forces?
-						cell_force(i) += (
-								body_force_values[q_point](component_i) *
-								local_quadrature_points_history[q_point].rho *
-								fe_values.shape_value (i,q_point)
-								-
-								new_stress *
-								get_strain (fe_values,i,q_point))
-								*
-								fe_values.JxW (q_point);
-					}
+					// how to handle body forces?
+					for (unsigned int i=0; i<dofs_per_cell; ++i)
+						cell_force(i) += scratch.body_force_values[q_point](fe.system_to_component_index(i).first)
+								* fe_values.shape_value (i,q_point)
+								* rho_JxW;
 				}
 
-				cell->get_dof_indices (local_dof_indices);
-
-				// Assemble local matrices for v problem
-				if(first_assemble) cell_v_matrix = cell_mass;
+				// Assembly of internal forces vector, also kept for the outputs of the timestep
+				Vector<double> &cell_internal_forces = copy.cell_internal_forces;
+				cell_internal_forces = 0;
+				add_cell_internal_forces (fe_values, first_qp, 1.0, cell_internal_forces);
+				cell_force.add (-1.0, cell_internal_forces);
 
-				//std::cout << "norm matrix " << cell_v_matrix.l1_norm() << " stiffness " << cell_stiffness.l1_norm() << std::endl;
+				cell->get_dof_indices (copy.local_dof_indices);
 
 				// Assemble local rhs for v problem
 				cell_v_rhs.add(fe_timestep_length, cell_force);
+			},
+				[&] (const CellCopyData &copy)
+			{
+				hanging_node_constraints
+						.distribute_local_to_global(copy.cell_internal_forces,
+								copy.local_dof_indices, internal_forces);
 
 				// Local to global for u and v problems
-				if(first_assemble) hanging_node_constraints
-										.distribute_local_to_global(cell_v_matrix, cell_v_rhs,
-												local_dof_indices,
+				if(use_lumped_mass){
+					if(first_assemble){
+						Vector<double> cell_lumped_mass (dofs_per_cell);
+						for (unsigned int i=0; i<dofs_per_cell; ++i)
+							cell_lumped_mass(i) = copy.cell_matrix(i,i);
+						hanging_node_constraints
+								.distribute_local_to_global(cell_lumped_mass,
+										copy.local_dof_indices, lumped_mass);
+					}
+					hanging_node_constraints
+							.distribute_local_to_global(copy.cell_vector,
+									copy.local_dof_indices, system_rhs);
+				}
+				else if(first_assemble) hanging_node_constraints
+										.distribute_local_to_global(copy.cell_matrix, copy.cell_vector,
+												copy.local_dof_indices,
 												system_matrix, system_rhs);
 				else hanging_node_constraints
-						.distribute_local_to_global(cell_v_rhs,
-								local_dof_indices, system_rhs);
-			}
+						.distribute_local_to_global(copy.cell_vector,
+								copy.local_dof_indices, system_rhs);
+			},
+			sample_scratch, sample_copy);
 
-		if(first_assemble){
+		if(use_lumped_mass){
+			if(first_assemble) lumped_mass.compress(VectorOperation::add);
+		}
+		else if(first_assemble){
 			system_matrix.compress(VectorOperation::add);
 			mass_matrix.copy_from(system_matrix);
 		}
 		else system_matrix.copy_from(mass_matrix);
 
 		system_rhs.compress(VectorOperation::add);
+		internal_forces.compress(VectorOperation::add);
 
 
 		FEValuesExtractors::Scalar x_component (dim-3);
@@ -862,13 +787,25 @@ namespace HMM
 		std::map<types::global_dof_index,double> boundary_values;
 		boundary_values = problem_type->boundary_conditions_to_zero(timestep);
 
-		PETScWrappers::MPI::Vector tmp (locally_owned_dofs,FE_communicator);
-		MatrixTools::apply_boundary_values (boundary_values,
-				system_matrix,
-				tmp,
-				system_rhs,
-				false);
-		newton_update_velocity = tmp;
+		if(use_lumped_mass){
+			// Same as applying the zero boundary values to a diagonal system: only the
+			// right hand side of the constrained dofs needs to be cancelled
+			for (std::map<types::global_dof_index,double>::const_iterator
+					p = boundary_values.begin(); p != boundary_values.end(); ++p)
+				if (locally_owned_dofs.is_element(p->first))
+					system_rhs(p->first) = 0.;
+			system_rhs.compress(VectorOperation::insert);
+			newton_update_velocity = 0;
+		}
+		else{
+			PETScWrappers::MPI::Vector tmp (locally_owned_dofs,FE_communicator);
+			MatrixTools::apply_boundary_values (boundary_values,
+					system_matrix,
+					tmp,
+					system_rhs,
+					false);
+			newton_update_velocity = tmp;
+		}
 
 		rhs_residual = system_rhs.l2_norm();
 		dcout << "    FE System - norm of rhs is " << rhs_residual
@@ -1018,6 +955,31 @@ namespace HMM
 
 
 
+	template <int dim>
+	void FEProblem<dim>::solve_lumped_mass ()
+	{
+		PETScWrappers::MPI::Vector
+		distributed_newton_update (locally_owned_dofs,FE_communicator);
+
+		// The mass matrix being diagonal, the update of the increment of velocity
+		// is the element-wise ratio of the right hand side and the lumped mass
+		// (dofs constrained by hanging nodes have no mass, and are distributed below)
+		std::pair<types::global_dof_index,types::global_dof_index> range = system_rhs.local_range();
+		for (types::global_dof_index i=range.first; i<range.second; ++i){
+			const double mass = lumped_mass(i);
+			distributed_newton_update(i) = (mass != 0.) ? system_rhs(i)/mass : 0.;
+		}
+		distributed_newton_update.compress(VectorOperation::insert);
+
+		newton_update_velocity = distributed_newton_update;
+		hanging_node_constraints.distribute (newton_update_velocity);
+
+		dcout << "    FE Solver - norm of newton update is " << newton_update_velocity.l2_norm()
+							  << std::endl;
+	}
+
+
+
 	template <int dim>
 	void FEProblem<dim>::update_incremental_variables ()
 	{
@@ -1039,155 +1001,106 @@ namespace HMM
 
 
 
+	// The necessity for update and the subsequent spline analysis should be conducted in another class, which would
+	// be provided with the strain state of all the QPs at each time step.
+	// Maybe worth doing that in the spline class
 	template <int dim>
 	void FEProblem<dim>::update_strain_quadrature_point_history(const Vector<double>& displacement_update)
 	{
-		// Preparing requirements for strain update
-		FEValues<dim> fe_values (fe, quadrature_formula,
+		// Single pass over the cells updating the strain, flagging the quadrature points requiring
+		// an MD update, extending their strain history and fitting its spline, and listing them
+		// (in cell order) for the history comparison and the MD update list
+		dcout << "        " << "...checking quadrature points requiring update based on current strain..." << std::endl;
+
+		double min_qp_strain;
+		min_qp_strain = input_config.get<double>("model precision.md.min quadrature strain norm");
+
+                // might be interesting to set them global and not reload them at every iteration?
+		num_spline_points = input_config.get<int>("model precision.clustering.spline points");
+		min_num_steps_before_spline = input_config.get<int>("model precision.clustering.min steps");
+		acceptable_diff_threshold = input_config.get<double>("model precision.clustering.diff threshold");
+
+		const bool build_splines = (timestep > min_num_steps_before_spline);
+		if (build_splines) dcout << "           " << "...building splines..." << std::endl;
+
+		struct QPCopyData
+		{
+			std::vector<unsigned int> md_candidates;
+		};
+
+		md_update_candidates.clear();
+
+		// Preparing requirements for strain update (cells are updated independently by all threads)
+		CellScratchData<dim> sample_scratch (fe, quadrature_formula,
 				update_values | update_gradients);
-		std::vector<std::vector<Tensor<1,dim> > >
-		displacement_update_grads (quadrature_formula.size(),
-				std::vector<Tensor<1,dim> >(dim));
 
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
+		WorkStream::run (LocallyOwnedCellIterator<dim>(IteratorFilters::LocallyOwnedCell(), dof_handler.begin_active()),
+				LocallyOwnedCellIterator<dim>(IteratorFilters::LocallyOwnedCell(), dof_handler.end()),
+				[&] (const LocallyOwnedCellIterator<dim> &cell, CellScratchData<dim> &scratch, QPCopyData &copy)
 			{
-				SymmetricTensor<2,dim> newton_strain_tensor;
+				copy.md_candidates.clear();
 
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-				fe_values.reinit (cell);
-				fe_values.get_function_gradients (displacement_update,
+				std::vector<std::vector<Tensor<1,dim> > > &displacement_update_grads
+				= scratch.displacement_update_grads;
+
+				const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
+				scratch.fe_values.reinit (cell);
+				scratch.fe_values.get_function_gradients (displacement_update,
 						displacement_update_grads);
 
 				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
 				{
-					local_quadrature_points_history[q].old_strain =
-							local_quadrature_points_history[q].new_strain;
-
-					local_quadrature_points_history[q].old_stress =
-							local_quadrature_points_history[q].new_stress;
+					const unsigned int k = first_qp + q;
 
-					local_quadrature_points_history[q].old_stiff =
-							local_quadrature_points_history[q].new_stiff;
+					quadrature_point_history.old_strain[k] =
+							quadrature_point_history.new_strain[k];
 
-					if (newtonstep == 0) local_quadrature_points_history[q].inc_strain = 0.;
+					quadrature_point_history.old_stress[k] =
+							quadrature_point_history.new_stress[k];
 
 					// Strain tensor update
-					local_quadrature_points_history[q].newton_strain = get_strain (displacement_update_grads[q]);
-					local_quadrature_points_history[q].inc_strain += local_quadrature_points_history[q].newton_strain;
-					local_quadrature_points_history[q].new_strain += local_quadrature_points_history[q].newton_strain;
-					local_quadrature_points_history[q].upd_strain += local_quadrature_points_history[q].newton_strain;
+					quadrature_point_history.newton_strain[k] = get_strain (displacement_update_grads[q]);
+					quadrature_point_history.new_strain[k] += quadrature_point_history.newton_strain[k];
+					quadrature_point_history.upd_strain[k] += quadrature_point_history.newton_strain[k];
+
+					MatHistPredict::Strain6D &hist_strain = quadrature_point_history.hist_strain[k];
 
 					// Add current strain to strain history
 					if(newtonstep>0){
-						local_quadrature_points_history[q].hist_strain.add_current_strain(
-									local_quadrature_points_history[q].new_strain[0][0],
-									local_quadrature_points_history[q].new_strain[1][1],
-									local_quadrature_points_history[q].new_strain[2][2],
-									local_quadrature_points_history[q].new_strain[0][1],
-									local_quadrature_points_history[q].new_strain[0][2],
-									local_quadrature_points_history[q].new_strain[1][2]);
+						const SymmetricTensor<2,dim> &new_strain = quadrature_point_history.new_strain[k];
+						hist_strain.add_current_strain(
+									new_strain[0][0],
+									new_strain[1][1],
+									new_strain[2][2],
+									new_strain[0][1],
+									new_strain[0][2],
+									new_strain[1][2]);
 						// remember the last ID used to get results from (WARNING: what about first timestep?)
-						local_quadrature_points_history[q].hist_strain.set_most_recent_ID_to_get_results_from(local_quadrature_points_history[q].hist_strain.get_ID_to_get_results_from());
+						hist_strain.set_most_recent_ID_to_get_results_from(hist_strain.get_ID_to_get_results_from());
 						// Default to get results from self
-						local_quadrature_points_history[q].hist_strain.set_ID_to_get_results_from(local_quadrature_points_history[q].qpid);
+						hist_strain.set_ID_to_get_results_from(quadrature_point_history.qpid[k]);
 					}
-				}
-			}
-	}
-
-
-
-
-	// The necessity for update and the subsequent spline analysis should be conducted in another class, which would
-	// be provided with the strain state of all the QPs at each time step.
-	// Maybe worth doing that in the spline class
-	template <int dim>
-	void FEProblem<dim>::check_strain_quadrature_point_history()
-	{
-		if (newtonstep > 0) dcout << "        " << "...checking quadrature points requiring update based on current strain..." << std::endl;
-		
-		double min_qp_strain;
-		min_qp_strain = input_config.get<double>("model precision.md.min quadrature strain norm");
 
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
-			{
-				SymmetricTensor<2,dim> newton_strain_tensor;
+					// MD simulation unecessary if no significant volume change, MD would fail
+					quadrature_point_history.to_be_updated_with_md[k] =
+							(stress_compute_method == 0
+								&& (quadrature_point_history.upd_strain[k].norm() >= min_qp_strain
+									|| quadrature_point_history.to_be_updated_with_md[k]));
 
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
+					if (quadrature_point_history.to_be_updated_with_md[k]){
+						if (build_splines)
+							hist_strain.splinify(num_spline_points);
 
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-				{
-					// Uncomment one on the 4 following "if" statement to derive stress tensor from MD for:
-					//   (i) all cells,
-					//  (ii) cells in given location,
-					// (iii) cells based on their id
-					if (stress_compute_method == 0
-						// otherwise MD simulation unecessary, because no significant volume change and MD will fail
-										&& (local_quadrature_points_history[q].upd_strain.norm() >= min_qp_strain//> 1.0e-10
-											|| local_quadrature_points_history[q].to_be_updated_with_md == true)
-						)
-					//if (stress_compute_method && cell->barycenter()(1) <  3.0*tt && cell->barycenter()(0) <  1.10*(ww - aa) && cell->barycenter()(0) > 0.0*(ww - aa))
-					/*if (stress_compute_method && (cell->active_cell_index() == 2922 || cell->active_cell_index() == 2923
-						|| cell->active_cell_index() == 2924 || cell->active_cell_index() == 2487
-						|| cell->active_cell_index() == 2488 || cell->active_cell_index() == 2489))*/ // For debug...
-					{
-						local_quadrature_points_history[q].to_be_updated_with_md = true;
-					}
-					else{
-						local_quadrature_points_history[q].to_be_updated_with_md = false;
+						copy.md_candidates.push_back(k);
 					}
 				}
-			}
-	}
-
-
-
-
-	template <int dim>
-	void FEProblem<dim>::spline_building()
-	{
-		dcout << "           " << "...building splines..." << std::endl;
-
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
+			},
+				[&] (const QPCopyData &copy)
 			{
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-				{
-					local_quadrature_points_history[q].hist_strain.splinify(num_spline_points);
-
-				}
-			}
+				md_update_candidates.insert(md_update_candidates.end(),
+						copy.md_candidates.begin(), copy.md_candidates.end());
+			},
+			sample_scratch, QPCopyData());
 	}
 
 
@@ -1200,73 +1113,18 @@ namespace HMM
 
 		// Building vector of (updateable) histories of cells on rank
 		std::vector<MatHistPredict::Strain6D*> histories;
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
-			{
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-				{
-					if(local_quadrature_points_history[q].to_be_updated_with_md)
-					{
-						histories.push_back(&local_quadrature_points_history[q].hist_strain);
-						//local_quadrature_points_history[q].hist_strain.print();
-					}
-				}
-			}
+		for (unsigned int i=0; i<md_update_candidates.size(); ++i)
+			histories.push_back(&quadrature_point_history.hist_strain[md_update_candidates[i]]);
 		MPI_Barrier(FE_communicator);
 		
     // Launch MPI communication to compare strain histories on this rank with histories on all other ranks (including this one).
 		// Results will be stored in the Strain6D objects - a vector of all other similar strain histories (i.e. within the given threshold difference).
 		MatHistPredict::compare_histories_with_all_ranks(histories, acceptable_diff_threshold, FE_communicator);
 
-		dcout << "           " << "...writing similarities to file..." << std::endl;
-		for(uint32_t i=0; i < histories.size(); i++) {
-			char outhistfname[1024];
-			sprintf(outhistfname, "%s/last.%d.similar_hist", macrostatelocout.c_str(), histories[i]->get_ID());
-			histories[i]->most_similar_histories_to_file(outhistfname);
-
-			sprintf(outhistfname, "%s/last.%d.all_similar_hist", macrostatelocout.c_str(), histories[i]->get_ID());
-			histories[i]->all_similar_histories_to_file(outhistfname);
-
-			/*sprintf(outhistfname, "%s/%d.%d.all_similar_hist", macrostatelocout.c_str(), timestep_no, histories[i]->get_ID());
-			histories[i]->all_similar_histories_to_file(outhistfname);*/
-		}
-
-		// Use networkx to coarsegrain the strain similarity graph, outputting the final list of cells to update using MD (jobs_to_run.csv),
-		// and where to get the stress results for the cells to be updated (mapping.csv). Script must run on only one rank.
-		MPI_Barrier(FE_communicator);
+		// Coarsegrain the strain similarity graph of all ranks, so that each cell to be updated knows from which
+		// (most connected) cell it should get its stress results, and only the latter are run with MD.
 		dcout << "           " << "...computing quadrature points reduced dependencies..." << std::endl;
-		if(this_FE_process == 0) {
-			char command[1024];
-			sprintf(command,
-					"python3 %s/coarsegrain_dependency_network.py %s %s/mapping.csv %d",
-					clusteringscriptsloc.c_str(),
-                                        macrostatelocout.c_str(),
-					macrostatelocout.c_str(),
-					triangulation.n_active_cells()*quadrature_formula.size()
-					);
-			int ret = system(command);
-			if (ret!=0){
-				std::cerr << "Failed completing coarse-graining of the update list dependency!" << std::endl;
-				exit(1);
-			}
-		}
-		MPI_Barrier(FE_communicator);
-
-		for(uint32_t i=0; i < histories.size(); i++) {
-			char mappingfname[1024];
-			sprintf(mappingfname, "%s/mapping.csv", macrostatelocout.c_str());
-			histories[i]->read_coarsegrain_dependency_mapping(mappingfname);
-		}
+		MatHistPredict::coarsegrain_dependency_network(histories, FE_communicator);
 	}
 
 
@@ -1276,16 +1134,10 @@ namespace HMM
 	void FEProblem<dim>::history_analysis()
 	{
 		dcout << "        " << "...comparing strain history of quadrature points to be updated..." << std::endl;
-	
-                // might be interesting to set them global and not reload them at every iteration?		
-		num_spline_points = input_config.get<int>("model precision.clustering.spline points");
-		min_num_steps_before_spline = input_config.get<int>("model precision.clustering.min steps");
-		acceptable_diff_threshold = input_config.get<double>("model precision.clustering.diff threshold");
-		clusteringscriptsloc = input_config.get<std::string>("model precision.clustering.scripts directory");
 
-		// Fit spline to all histories, and determine similarity graph (over all ranks)
+		// Determine similarity graph (over all ranks) of the histories, which splines
+		// were fitted during the strain update
 		if(timestep > min_num_steps_before_spline) {
-			spline_building();
 			spline_comparison();
 		}
 	}
@@ -1301,65 +1153,39 @@ namespace HMM
 
 		std::vector<SymmetricTensor<2,dim> > update_strains;
 
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
+		// Only the quadrature points flagged during the strain update are considered
+		for (unsigned int i=0; i<md_update_candidates.size(); ++i)
+		{
+			const unsigned int k = md_update_candidates[i];
+			MatHistPredict::Strain6D &hist_strain = quadrature_point_history.hist_strain[k];
+
+			// The quadrature point will get its stress from MD, but should it run an MD simulation?
+			if (hist_strain.run_new_md())
 			{
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-					if(local_quadrature_points_history[q].to_be_updated_with_md
-							&& local_quadrature_points_history[q].hist_strain.run_new_md())
-					{
-						// The cell will get its stress from MD, but should it run an MD simulation?
-						if (true
-							// in case of extreme straining with reaxff
-							/*&& !(avg_new_stress_tensor.norm() < 1.0e8 && avg_new_strain_tensor.norm() > 3.0)*/
-							){
-							//std::cout << "           "
-							//		<< " cell_id "<< cell->active_cell_index()
-							//		<< " upd norm " << local_quadrature_points_history[q].upd_strain.norm()
-							//		<< " total norm " << local_quadrature_points_history[q].new_strain.norm()
-							//		<< " total stress norm " << local_quadrature_points_history[q].new_stress.norm()
-							//		<< std::endl;
-
-							QP qp; // Struct that holds information for md job
-
-							// Write strains since last update in a file named ./macrostate_storage/last.cellid-qid.strain
-							//char cell_id[1024]; sprintf(cell_id, "%d", local_quadrature_points_history[q].qpid);
-							//char filename[1024];
-
-							SymmetricTensor<2,dim> rot_avg_upd_strain_tensor;
-
-							rot_avg_upd_strain_tensor =
-										rotate_tensor(local_quadrature_points_history[q].upd_strain, local_quadrature_points_history[q].rotam);
-												
-							for (int i=0; i<6; i++){
-								qp.update_strain[i] = rot_avg_upd_strain_tensor.access_raw_entry(i); 
-							}
-							qp.id = local_quadrature_points_history[q].qpid;
-							qp.most_recent_id = local_quadrature_points_history[q].hist_strain.get_most_recent_ID_to_get_results_from();
-							qp.material = celldata.get_composition(cell->active_cell_index());
-							scale_bridging_data.update_list.push_back(qp);
-							//sprintf(filename, "%s/last.%s.upstrain", macrostatelocout.c_str(), cell_id);
-							//write_tensor<dim>(filename, rot_avg_upd_strain_tensor);
-
-							// qpupdates.push_back(local_quadrature_points_history[q].qpid); //MPI list of qps to update on this rank
-							//std::cout<< "local qpid "<< local_quadrature_points_history[q].qpid << std::endl;
-						}
-					} 
+				QP qp; // Struct that holds information for md job
+
+				SymmetricTensor<2,dim> rot_avg_upd_strain_tensor;
+
+				rot_avg_upd_strain_tensor =
+							rotate_tensor(quadrature_point_history.upd_strain[k], quadrature_point_history.rotation(k));
+
+				for (int j=0; j<6; j++){
+					qp.update_strain[j] = rot_avg_upd_strain_tensor.access_raw_entry(j);
+				}
+				qp.id = quadrature_point_history.qpid[k];
+				qp.most_recent_id = hist_strain.get_most_recent_ID_to_get_results_from();
+				qp.material = quadrature_point_history.material[k];
+				scale_bridging_data.update_list.push_back(qp);
 			}
-		// Gathering in a single file all the quadrature points to be updated...
-		// Might be worth replacing indivual local file writings by a parallel vector of string
-		// and globalizing this vector before this final writing step.
-		gather_qp_update_list(scale_bridging_data);
+		}
+
+		// The quadrature points to be updated stay on this process, they are routed to the MD
+		// processes by the driver, which only returns the stresses of the updates requested here
+		std::vector<int> &requested_ids = scale_bridging_data.requested_ids;
+		for (unsigned int i=0; i<md_update_candidates.size(); ++i)
+			requested_ids.push_back(quadrature_point_history.hist_strain[md_update_candidates[i]].get_ID_to_get_results_from());
+		std::sort(requested_ids.begin(), requested_ids.end());
+		requested_ids.erase(std::unique(requested_ids.begin(), requested_ids.end()), requested_ids.end());
 		//std::vector<int> all_qpupdates;
 		///all_qpupdates = gather_vector<int>(qpupdates);
 		;
@@ -1372,12 +1198,6 @@ namespace HMM
 		
 	}
 
-	template <int dim>
-	void FEProblem<dim>::gather_qp_update_list(ScaleBridgingData &scale_bridging_data)
-	{
-		scale_bridging_data.update_list = gather_vector<QP>(scale_bridging_data.update_list);
-	}
-			
 	template <int dim>
 	template <typename T>
 	std::vector<T> FEProblem<dim>::gather_vector(std::vector<T> local_vector)
@@ -1466,26 +1286,6 @@ namespace HMM
 		return gathered_vector;
 	}
 
-	QP get_qp_with_id (int cell_id, ScaleBridgingData scale_bridging_data)
-	{
-		QP qp; 
-		bool found = false;
-		int n_qp = scale_bridging_data.update_list.size();
-
-		for (int i=0; i<n_qp; i++){
-			if (scale_bridging_data.update_list[i].id == cell_id){
-				qp = scale_bridging_data.update_list[i];
-				found = true;
-				break;
-			}
-		}
-		if (found == false){
-			std::cout << "Error: No QP objecr with id "<< cell_id << std::endl;
-			exit(1);
-		}
-		return qp;
-	}
-
 	template <int dim>
 	SymmetricTensor<2,dim> FEProblem<dim>::compute_stress_with_surrogate(SymmetricTensor<2,dim> old_strain,
 																		 SymmetricTensor<2,dim> new_strain,
@@ -1629,50 +1429,27 @@ namespace HMM
 	}
 
 	template <int dim>
-	void FEProblem<dim>::update_stress_quadrature_point_history(const Vector<double>& displacement_update,
-			ScaleBridgingData scale_bridging_data)
+	void FEProblem<dim>::update_stress_quadrature_point_history(const ScaleBridgingData &scale_bridging_data)
 	{
-		FEValues<dim> fe_values (fe, quadrature_formula,
-				update_values | update_gradients);
-		std::vector<std::vector<Tensor<1,dim> > >
-		displacement_update_grads (quadrature_formula.size(),
-				std::vector<Tensor<1,dim> >(dim));
-
 		char time_id[1024]; sprintf(time_id, "%d-%d", timestep, newtonstep);
 
+		// The strain increments were stored at the quadrature points during the strain
+		// update, the stress update therefore runs directly over the (locally owned)
+		// quadrature points, without going back through the cells
+		QuadraturePointStore<dim> &qp_store = quadrature_point_history;
+
 		// Retrieving all quadrature points computation and storing them in the
 		// quadrature_points_history structure
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell){
-			if (cell->is_locally_owned())
+		auto update_qp_stress = [&] (const unsigned int begin_qp, const unsigned int end_qp)
 			{
-				SymmetricTensor<2,dim> avg_upd_strain_tensor;
-				//SymmetricTensor<2,dim> avg_stress_tensor;
-
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-				fe_values.reinit (cell);
-				fe_values.get_function_gradients (displacement_update,
-						displacement_update_grads);
-
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
+				for (unsigned int k=begin_qp; k<end_qp; ++k)
 				{
-					int qp_id = local_quadrature_points_history[q].hist_strain.get_ID_to_get_results_from();
-
-					if (newtonstep == 0) local_quadrature_points_history[q].inc_stress = 0.;
+					int qp_id = qp_store.hist_strain[k].get_ID_to_get_results_from();
 
 					if (stress_compute_method==0){
-						if (local_quadrature_points_history[q].to_be_updated_with_md){
+						if (qp_store.to_be_updated_with_md[k]){
 
-							QP qp;
-							qp = get_qp_with_id(qp_id, scale_bridging_data);
+							const QPStress &qp = scale_bridging_data.get_stress_with_id(qp_id);
 							//sprintf(filename, "%s/last.%s.stress", macrostatelocout.c_str(), cell_id);
 							//load_stress = read_tensor<dim>(filename, loc_stress);
 							//std::cout << "Putting stress into quadrature_points_history" << std::endl;
@@ -1682,40 +1459,46 @@ namespace HMM
 							SymmetricTensor<2,dim> loc_stress(qp.update_stress);
 
 							// Rotate the output stress wrt the flake angles
-							loc_stress = rotate_tensor(loc_stress, transpose(local_quadrature_points_history[q].rotam));
+							loc_stress = rotate_tensor(loc_stress, transpose(qp_store.rotation(k)));
 
 							if (approx_md_with_hookes_law == false){
-								local_quadrature_points_history[q].new_stress = loc_stress;
+								qp_store.new_stress[k] = loc_stress;
 							}
 							else {
-								local_quadrature_points_history[q].new_stress = loc_stress + local_quadrature_points_history[q].old_stress;
+								qp_store.new_stress[k] = loc_stress + qp_store.old_stress[k];
 							}
 
 							// Resetting the update strain tensor
-							local_quadrature_points_history[q].upd_strain = 0;
+							qp_store.upd_strain[k] = 0;
 						}
 						else {
-							local_quadrature_points_history[q].new_stress +=                                                                                                    local_quadrature_points_history[q].new_stiff*local_quadrature_points_history[q].newton_strain;                                                                                                                                            						}
+							qp_store.new_stress[k] += qp_store.stiffness(k)*qp_store.newton_strain[k];
+						}
 					}
 					else if (stress_compute_method==1
-							//|| (local_quadrature_points_history[q].qpid != 0)
+							//|| (qp_store.qpid[k] != 0)
 							){
 						// Tangent stiffness computation of the new stress tensor
-						local_quadrature_points_history[q].new_stress +=
-								local_quadrature_points_history[q].new_stiff*local_quadrature_points_history[q].newton_strain;
+						qp_store.new_stress[k] +=
+								qp_store.stiffness(k)*qp_store.newton_strain[k];
 					}
 					else if (stress_compute_method==2){
-						local_quadrature_points_history[q].new_stress = compute_stress_with_surrogate(local_quadrature_points_history[q].old_strain,
-								local_quadrature_points_history[q].new_strain,
-								local_quadrature_points_history[q].old_stress);
+						qp_store.new_stress[k] = compute_stress_with_surrogate(qp_store.old_strain[k],
+								qp_store.new_strain[k],
+								qp_store.old_stress[k]);
 					}
 					else {
 						std::cerr << "Local stress computation method not implemented." << std::endl;
 						exit(1);
 					}
 				}
-			}
-		}
+			};
+
+		// The surrogate model goes through the (single-threaded) python interpreter
+		if (stress_compute_method==2)
+			update_qp_stress (0, quadrature_point_history.size());
+		else parallel::apply_to_subranges (0U, quadrature_point_history.size(),
+				update_qp_stress, quadrature_formula.size());
 		/*MPI_Barrier(FE_communicator);
 		// Retrieving all quadrature points computation and storing them in the
 		// quadrature_points_history structure
@@ -1771,14 +1554,14 @@ namespace HMM
 				cell != dof_handler.end(); ++cell)
 			if (cell->is_locally_owned())
 			{
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
+				const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
 
 				for (unsigned int q=0; q<quadrature_formula.size(); ++q){
-					char cell_id[1024]; sprintf(cell_id, "%d", local_quadrature_points_history[q].qpid);
+					const unsigned int k = first_qp + q;
+					char cell_id[1024]; sprintf(cell_id, "%d", quadrature_point_history.qpid[k]);
 
-					if(local_quadrature_points_history[q].to_be_updated_with_md
-							&& local_quadrature_points_history[q].hist_strain.run_new_md()){
+					if(quadrature_point_history.to_be_updated_with_md[k]
+							&& quadrature_point_history.hist_strain[k].run_new_md()){
 						// Removing stiffness passing file
 						//sprintf(filename, "%s/last.%s.stiff", macrostatelocout.c_str(), cell_id);
 						//remove(filename);
@@ -1799,81 +1582,48 @@ namespace HMM
 
 
 	template <int dim>
-	Vector<double> FEProblem<dim>::compute_internal_forces () const
+	void FEProblem<dim>::add_cell_internal_forces (const FEValues<dim> &fe_values,
+			const unsigned int first_qp,
+			const double factor, Vector<double> &cell_vector) const
 	{
-		PETScWrappers::MPI::Vector residual
-		(locally_owned_dofs, FE_communicator);
-
-		residual = 0;
-
-		FEValues<dim> fe_values (fe, quadrature_formula,
-				update_values   | update_gradients |
-				update_quadrature_points | update_JxW_values);
-
 		const unsigned int   dofs_per_cell = fe.dofs_per_cell;
 		const unsigned int   n_q_points    = quadrature_formula.size();
 
-		Vector<double>               cell_residual (dofs_per_cell);
-
-		std::vector<types::global_dof_index> local_dof_indices (dofs_per_cell);
-
-		typename DoFHandler<dim>::active_cell_iterator
-		cell = dof_handler.begin_active(),
-		endc = dof_handler.end();
-		for (; cell!=endc; ++cell)
-			if (cell->is_locally_owned())
-			{
-				cell_residual = 0;
-				fe_values.reinit (cell);
-
-				const PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim>*>(cell->user_pointer());
-
-				for (unsigned int i=0; i<dofs_per_cell; ++i)
-				{
-					for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
-					{
-						const SymmetricTensor<2,dim> &old_stress
-						= local_quadrature_points_history[q_point].new_stress;
-
-						cell_residual(i) +=
-								(old_stress *
-								get_strain (fe_values,i,q_point))
-								*
-								fe_values.JxW (q_point);
-					}
-				}
-
-				cell->get_dof_indices (local_dof_indices);
-				hanging_node_constraints.distribute_local_to_global
-				(cell_residual, local_dof_indices, residual);
-			}
+		// The shape functions being primitive, the strain of shape function i at q_point only
+		// involves the gradient of its non-zero component c, and stress:strain(i) reduces to
+		// the dot product of row c of the (symmetric) stress with this gradient. Rows are
+		// scaled by JxW once per quadrature point, instead of once per shape function.
+		std::vector<unsigned int> component (dofs_per_cell);
+		for (unsigned int i=0; i<dofs_per_cell; ++i)
+			component[i] = fe.system_to_component_index(i).first;
 
-		residual.compress(VectorOperation::add);
+		for (unsigned int q_point=0; q_point<n_q_points; ++q_point)
+		{
+			const SymmetricTensor<2,dim> &stress
+			= quadrature_point_history.new_stress[first_qp+q_point];
 
-		Vector<double> local_residual (dof_handler.n_dofs());
-		local_residual = residual;
+			Tensor<1,dim> stress_JxW[dim];
+			for (unsigned int c=0; c<dim; ++c)
+				for (unsigned int j=0; j<dim; ++j)
+					stress_JxW[c][j] = factor * stress[c][j] * fe_values.JxW (q_point);
 
-		return local_residual;
+			for (unsigned int i=0; i<dofs_per_cell; ++i)
+				cell_vector(i) += stress_JxW[component[i]] * fe_values.shape_grad (i,q_point);
+		}
 	}
 
 
 
-
 	template <int dim>
 	std::vector< std::vector< Vector<double> > >
 	FEProblem<dim>::compute_history_projection_from_qp_to_nodes (FE_DGQ<dim> &history_fe, DoFHandler<dim> &history_dof_handler, std::string stensor) const
 	{
 		std::vector< std::vector< Vector<double> > >
-		             history_field (dim, std::vector< Vector<double> >(dim)),
-		             local_history_values_at_qpoints (dim, std::vector< Vector<double> >(dim)),
-		             local_history_fe_values (dim, std::vector< Vector<double> >(dim));
+		             history_field (dim, std::vector< Vector<double> >(dim));
 		for (unsigned int i=0; i<dim; i++)
 		  for (unsigned int j=0; j<dim; j++)
 		  {
 		    history_field[i][j].reinit(history_dof_handler.n_dofs());
-		    local_history_values_at_qpoints[i][j].reinit(quadrature_formula.size());
-		    local_history_fe_values[i][j].reinit(history_fe.dofs_per_cell);
 		  }
 		FullMatrix<double> qpoint_to_dof_matrix (history_fe.dofs_per_cell,
 		                                         quadrature_formula.size());
@@ -1881,57 +1631,74 @@ namespace HMM
 		          (history_fe,
 		           quadrature_formula, quadrature_formula,
 		           qpoint_to_dof_matrix);
-		typename DoFHandler<dim>::active_cell_iterator cell = dof_handler.begin_active(),
-		                                               endc = dof_handler.end(),
-		                                               dg_cell = history_dof_handler.begin_active();
-		for (; cell!=endc; ++cell, ++dg_cell){
-			if (cell->is_locally_owned()){
-				PointHistory<dim> *local_quadrature_points_history
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
-				Assert (local_quadrature_points_history >=
-						&quadrature_point_history.front(),
-						ExcInternalError());
-				Assert (local_quadrature_points_history <
-						&quadrature_point_history.back(),
-						ExcInternalError());
-				for (unsigned int i=0; i<dim; i++){
-					for (unsigned int j=0; j<dim; j++)
-					{
-						for (unsigned int q=0; q<quadrature_formula.size(); ++q){
-							if (stensor == "strain"){
-								local_history_values_at_qpoints[i][j](q)
-				                		   = local_quadrature_points_history[q].new_strain[i][j];
-							}
-							else if(stensor == "stress"){
-								local_history_values_at_qpoints[i][j](q)
-				                		   = local_quadrature_points_history[q].new_stress[i][j];
-							}
-							else{
-								std::cerr << "Error: Neither 'stress' nor 'strain' to be projected to DOFs..." << std::endl;
+
+		// Local values of each cell (one copy per thread), the dofs of the
+		// discontinuous history_fe being only written by their own cell
+		struct ProjectionScratchData
+		{
+			ProjectionScratchData (const unsigned int n_q_points, const unsigned int dofs_per_cell)
+			:
+				local_history_values_at_qpoints (dim, std::vector< Vector<double> >(dim, Vector<double>(n_q_points))),
+				local_history_fe_values (dim, std::vector< Vector<double> >(dim, Vector<double>(dofs_per_cell)))
+			{}
+
+			std::vector< std::vector< Vector<double> > > local_history_values_at_qpoints;
+			std::vector< std::vector< Vector<double> > > local_history_fe_values;
+		};
+
+		WorkStream::run (dof_handler.begin_active(), dof_handler.end(),
+				[&] (const typename DoFHandler<dim>::active_cell_iterator &cell, ProjectionScratchData &scratch, CellCopyData &)
+			{
+				std::vector< std::vector< Vector<double> > >
+				             &local_history_values_at_qpoints = scratch.local_history_values_at_qpoints,
+				             &local_history_fe_values = scratch.local_history_fe_values;
+
+				typename DoFHandler<dim>::active_cell_iterator
+				dg_cell (&triangulation, cell->level(), cell->index(), &history_dof_handler);
+
+				if (cell->is_locally_owned()){
+					const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
+					for (unsigned int i=0; i<dim; i++){
+						for (unsigned int j=0; j<dim; j++)
+						{
+							for (unsigned int q=0; q<quadrature_formula.size(); ++q){
+								if (stensor == "strain"){
+									local_history_values_at_qpoints[i][j](q)
+					                		   = quadrature_point_history.new_strain[first_qp+q][i][j];
+								}
+								else if(stensor == "stress"){
+									local_history_values_at_qpoints[i][j](q)
+					                		   = quadrature_point_history.new_stress[first_qp+q][i][j];
+								}
+								else{
+									std::cerr << "Error: Neither 'stress' nor 'strain' to be projected to DOFs..." << std::endl;
+								}
 							}
+							qpoint_to_dof_matrix.vmult (local_history_fe_values[i][j],
+									local_history_values_at_qpoints[i][j]);
+							dg_cell->set_dof_values (local_history_fe_values[i][j],
+									history_field[i][j]);
 						}
-						qpoint_to_dof_matrix.vmult (local_history_fe_values[i][j],
-								local_history_values_at_qpoints[i][j]);
-						dg_cell->set_dof_values (local_history_fe_values[i][j],
-								history_field[i][j]);
 					}
 				}
-			}
-			else{
-				for (unsigned int i=0; i<dim; i++){
-					for (unsigned int j=0; j<dim; j++)
-					{
-						for (unsigned int q=0; q<quadrature_formula.size(); ++q){
-							local_history_values_at_qpoints[i][j](q) = -1e+20;
+				else{
+					for (unsigned int i=0; i<dim; i++){
+						for (unsigned int j=0; j<dim; j++)
+						{
+							for (unsigned int q=0; q<quadrature_formula.size(); ++q){
+								local_history_values_at_qpoints[i][j](q) = -1e+20;
+							}
+							qpoint_to_dof_matrix.vmult (local_history_fe_values[i][j],
+									local_history_values_at_qpoints[i][j]);
+							dg_cell->set_dof_values (local_history_fe_values[i][j],
+									history_field[i][j]);
 						}
-						qpoint_to_dof_matrix.vmult (local_history_fe_values[i][j],
-								local_history_values_at_qpoints[i][j]);
-						dg_cell->set_dof_values (local_history_fe_values[i][j],
-								history_field[i][j]);
 					}
 				}
-			}
-		}
+			},
+				[] (const CellCopyData &) {},
+			ProjectionScratchData (quadrature_formula.size(), history_fe.dofs_per_cell),
+			CellCopyData (0));
 
 		return history_field;
 	}
@@ -1941,21 +1708,22 @@ namespace HMM
     template <int dim>
     void FEProblem<dim>::output_lbc_force ()
     {
-            // Compute applied force vector
-            Vector<double> local_residual (dof_handler.n_dofs());
-            local_residual = compute_internal_forces(); // Note that local_residual contains the local force at all nodes of the mesh on all ranks
+            // Compute force under the loading boundary condition, from the internal forces
+            // of the dofs owned by each processor
+            double local_aforce = 0.;
+            const std::pair<types::global_dof_index,types::global_dof_index> range = internal_forces.local_range();
+            for (types::global_dof_index i=range.first; i<range.second; ++i)
+                    if (problem_type->is_vertex_loaded(i) == true)
+                    {
+                            local_aforce += internal_forces(i);
+                    }
+
+            double aforce = 0.;
+            MPI_Reduce(&local_aforce, &aforce, 1, MPI_DOUBLE, MPI_SUM, 0, FE_communicator);
 
             // Write specific outputs to file
             if (this_FE_process==0)
             {
-           	 	// Compute force under the loading boundary condition
-           	 	double aforce = 0.;
-           	 	for (unsigned int i=0; i<dof_handler.n_dofs(); ++i)
-           	 	        if (problem_type->is_vertex_loaded(i) == true)
-           	 	        {
-           	 	                aforce += local_residual[i];
-           	 	        }
-
                     std::ofstream ofile;
                     char fname[1024]; sprintf(fname, "%s/loadedbc_force.csv", macrologloc.c_str());
 
@@ -1986,62 +1754,32 @@ namespace HMM
 	{
 		char filename[1024];
 
-		// Initialization of the processor local history data file
-		sprintf(filename, "%s/pr_%d.lhistory.csv", macrologloc.c_str(), this_FE_process);
-		std::ofstream  lhprocout(filename, std::ios_base::app);
-		long cursor_position = lhprocout.tellp();
-
-		if (cursor_position == 0)
-		{
-			lhprocout << "timestep,time,qpid,cell,qpoint,material";
-			for(unsigned int k=0;k<dim;k++)
-				for(unsigned int l=k;l<dim;l++)
-					lhprocout << "," << "strain_" << k << l;
-			for(unsigned int k=0;k<dim;k++)
-				for(unsigned int l=k;l<dim;l++)
-					lhprocout  << "," << "updstrain_" << k << l;
-			for(unsigned int k=0;k<dim;k++)
-				for(unsigned int l=k;l<dim;l++)
-					lhprocout << "," << "stress_" << k << l;
-			lhprocout << std::endl;
-		}
+		// Strain, update strain and stress of all the quadrature points appended as a new chunk
+		// of columns to a single file shared by all the processors (the material of each quadrature
+		// point is listed in cell_id_mat.list of the macroscale output directory)
+		sprintf(filename, "%s/lhistory.bin", macrologloc.c_str());
 
-		// Output of complete local history in a single file per processor
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
-			{
-				char cell_id[1024]; sprintf(cell_id, "%d", cell->active_cell_index());
+		const std::vector<SymmetricTensor<2,dim> > *fields[3] = {&quadrature_point_history.new_strain,
+				&quadrature_point_history.upd_strain, &quadrature_point_history.new_stress};
+		const std::string field_names[3] = {"strain_", "updstrain_", "stress_"};
 
-				PointHistory<dim> *local_qp_hist
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
+		const unsigned int n_local_qp = quadrature_point_history.size();
+		std::vector<int64_t> qpids (n_local_qp);
+		for (unsigned int qp=0; qp<n_local_qp; ++qp)
+			qpids[qp] = quadrature_point_history.qpid[qp];
 
-				// Save strain, updstrain, stress history in one file per proc
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-				{
-					lhprocout << timestep
-							<< "," << present_time
-							<< "," << local_qp_hist[q].qpid
-							<< "," << cell->active_cell_index()
-							<< "," << q
-							<< "," << local_qp_hist[q].mat.c_str();
-					for(unsigned int k=0;k<dim;k++)
-						for(unsigned int l=k;l<dim;l++){
-							lhprocout << "," << std::setprecision(16) << local_qp_hist[q].new_strain[k][l];
-						}
-					for(unsigned int k=0;k<dim;k++)
-						for(unsigned int l=k;l<dim;l++){
-							lhprocout << "," << std::setprecision(16) << local_qp_hist[q].upd_strain[k][l];
-						}
-					for(unsigned int k=0;k<dim;k++)
-						for(unsigned int l=k;l<dim;l++){
-							lhprocout << "," << std::setprecision(16) << local_qp_hist[q].new_stress[k][l];
-						}
-					lhprocout << std::endl;
+		std::vector<std::string> column_names;
+		std::vector<double> columns;
+		for(unsigned int f=0;f<3;f++)
+			for(unsigned int k=0;k<dim;k++)
+				for(unsigned int l=k;l<dim;l++){
+					column_names.push_back(field_names[f] + std::to_string(k) + std::to_string(l));
+					for (unsigned int qp=0; qp<n_local_qp; ++qp)
+						columns.push_back((*fields[f])[qp][k][l]);
 				}
-			}
-		lhprocout.close();
+
+		append_qp_timeseries_chunk(filename, timestep, present_time, column_names, columns, qpids,
+				int64_t(triangulation.n_active_cells())*quadrature_formula.size(), FE_communicator);
 	}
 
 
@@ -2050,8 +1788,9 @@ namespace HMM
 	template <int dim>
 	void FEProblem<dim>::output_visualisation_history ()
 	{
-		// Data structure for VTK output
-		DataOut<dim> data_out;
+		// Data structure for VTK output, kept by the writer until the file is written
+		std::shared_ptr<VisualisationDataOut<dim> > data_out_snapshot (new VisualisationDataOut<dim>);
+		VisualisationDataOut<dim> &data_out = *data_out_snapshot;
 		data_out.attach_dof_handler (history_dof_handler);
 
 		// Output of the cell norm of the averaged strain tensor over quadrature
@@ -2074,50 +1813,18 @@ namespace HMM
 
 		data_out.build_patches ();
 
-		// Grouping spatially partitioned outputs
-		std::string filename = macrologloc + "/" + "history-" + Utilities::int_to_string(timestep,4)
-		+ "." + Utilities::int_to_string(this_FE_process,3)
-		+ ".vtu";
-		AssertThrow (n_FE_processes < 1000, ExcNotImplemented());
-
-		std::ofstream output (filename.c_str());
-		data_out.write_vtu (output);
+		// Single file for all the processors, written in the background when more than one thread is available
+		const std::string filename = "history-" + Utilities::int_to_string(timestep,4) + ".vtu";
+		visualisation_writer.write (data_out_snapshot, macrologloc + "/" + filename, FE_communicator);
 
-		MPI_Barrier(FE_communicator); // just to be safe
 		if (this_FE_process==0)
 		{
-			std::vector<std::string> filenames_loc;
-			for (unsigned int i=0; i<n_FE_processes; ++i)
-				filenames_loc.push_back ("history-" + Utilities::int_to_string(timestep,4)
-			+ "." + Utilities::int_to_string(i,3)
-			+ ".vtu");
-
-			const std::string
-			visit_master_filename = (macrologloc + "/" + "history-" +
-					Utilities::int_to_string(timestep,4) +
-					".visit");
-			std::ofstream visit_master (visit_master_filename.c_str());
-			//data_out.write_visit_record (visit_master, filenames_loc); // 8.4.1
-			DataOutBase::write_visit_record (visit_master, filenames_loc); // 8.5.0
-
-			const std::string
-			pvtu_master_filename = (macrologloc + "/" + "history-" +
-					Utilities::int_to_string(timestep,4) +
-					".pvtu");
-			std::ofstream pvtu_master (pvtu_master_filename.c_str());
-			data_out.write_pvtu_record (pvtu_master, filenames_loc);
-
 			static std::vector<std::pair<double,std::string> > times_and_names;
-			const std::string
-						pvtu_master_filename_loc = ("history-" +
-								Utilities::int_to_string(timestep,4) +
-								".pvtu");
-			times_and_names.push_back (std::pair<double,std::string> (present_time, pvtu_master_filename_loc));
+			times_and_names.push_back (std::pair<double,std::string> (present_time, filename));
 			std::ofstream pvd_output (macrologloc + "/" + "history.pvd");
 			//data_out.write_pvd_record (pvd_output, times_and_names); // 8.4.1
 			DataOutBase::write_pvd_record (pvd_output, times_and_names); // 8.5.0
 		}
-		MPI_Barrier(FE_communicator);
 	}
 
 
@@ -2126,8 +1833,9 @@ namespace HMM
 	template <int dim>
 	void FEProblem<dim>::output_visualisation_solution ()
 	{
-		// Data structure for VTK output
-		DataOut<dim> data_out;
+		// Data structure for VTK output, kept by the writer until the file is written
+		std::shared_ptr<VisualisationDataOut<dim> > data_out_snapshot (new VisualisationDataOut<dim>);
+		VisualisationDataOut<dim> &data_out = *data_out_snapshot;
 		data_out.attach_dof_handler (dof_handler);
 
 		// Output of displacement as a vector
@@ -2148,7 +1856,8 @@ namespace HMM
 				data_component_interpretation);
 
 		// Output of internal forces as a vector
-		Vector<double> fint = compute_internal_forces ();
+		Vector<double> fint (dof_handler.n_dofs());
+		fint = internal_forces;
 		std::vector<std::string>  fint_names (dim, "fint");
 		data_out.add_data_vector (fint,
 				fint_names,
@@ -2167,10 +1876,10 @@ namespace HMM
 				for (; cell!=endc; ++cell)
 					if (cell->is_locally_owned())
 					{
+						const unsigned int first_qp = quadrature_point_history.cell_range_begin(cell);
 						double accumulated_stiffi = 0.;
 						for (unsigned int q=0;q<quadrature_formula.size();++q)
-							accumulated_stiffi += reinterpret_cast<PointHistory<dim>*>
-								(cell->user_pointer())[q].new_stiff[i][i][i][i];
+							accumulated_stiffi += quadrature_point_history.stiffness(first_qp+q)[i][i][i][i];
 
 						avg_stiff[i](cell->active_cell_index()) = accumulated_stiffi/quadrature_formula.size();
 					}
@@ -2207,50 +1916,18 @@ namespace HMM
 
 		data_out.build_patches ();
 
-		// Grouping spatially partitioned outputs
-		std::string filename = macrologloc + "/" + "solution-" + Utilities::int_to_string(timestep,4)
-		+ "." + Utilities::int_to_string(this_FE_process,3)
-		+ ".vtu";
-		AssertThrow (n_FE_processes < 1000, ExcNotImplemented());
-
-		std::ofstream output (filename.c_str());
-		data_out.write_vtu (output);
+		// Single file for all the processors, written in the background when more than one thread is available
+		const std::string filename = "solution-" + Utilities::int_to_string(timestep,4) + ".vtu";
+		visualisation_writer.write (data_out_snapshot, macrologloc + "/" + filename, FE_communicator);
 
-		MPI_Barrier(FE_communicator); // just to be safe
 		if (this_FE_process==0)
 		{
-			std::vector<std::string> filenames_loc;
-			for (unsigned int i=0; i<n_FE_processes; ++i)
-				filenames_loc.push_back ("solution-" + Utilities::int_to_string(timestep,4)
-			+ "." + Utilities::int_to_string(i,3)
-			+ ".vtu");
-
-			const std::string
-			visit_master_filename = (macrologloc + "/" + "solution-" +
-					Utilities::int_to_string(timestep,4) +
-					".visit");
-			std::ofstream visit_master (visit_master_filename.c_str());
-			//data_out.write_visit_record (visit_master, filenames_loc); // 8.4.1
-			DataOutBase::write_visit_record (visit_master, filenames_loc); // 8.5.0
-
-			const std::string
-			pvtu_master_filename = (macrologloc + "/" + "solution-" +
-					Utilities::int_to_string(timestep,4) +
-					".pvtu");
-			std::ofstream pvtu_master (pvtu_master_filename.c_str());
-			data_out.write_pvtu_record (pvtu_master, filenames_loc);
-
 			static std::vector<std::pair<double,std::string> > times_and_names;
-			const std::string
-						pvtu_master_filename_loc = ("solution-" +
-								Utilities::int_to_string(timestep,4) +
-								".pvtu");
-			times_and_names.push_back (std::pair<double,std::string> (present_time, pvtu_master_filename_loc));
+			times_and_names.push_back (std::pair<double,std::string> (present_time, filename));
 			std::ofstream pvd_output (macrologloc + "/" + "solution.pvd");
 			//data_out.write_pvd_record (pvd_output, times_and_names); // 8.4.1
 			DataOutBase::write_pvd_record (pvd_output, times_and_names); // 8.5.0
 		}
-		MPI_Barrier(FE_communicator);
 	}
 
 
@@ -2264,8 +1941,10 @@ namespace HMM
 		// Output local history by processor
 		if(timestep%freq_output_lhist==0) output_lhistory ();
 
-		// Output visualisation files for paraview
+		// Output visualisation files for paraview, once the files of the previous
+		// output have been written
 		if(timestep%freq_output_visu==0){
+			visualisation_writer.flush();
 			output_visualisation_history();
 			output_visualisation_solution();
 		}
@@ -2280,58 +1959,36 @@ namespace HMM
 	{
 		char filename[1024];
 
-		// Copy of the solution vector at the end of the presently converged time-step.
-		MPI_Barrier(FE_communicator);
-		if (this_FE_process==0)
+		// Copy of the solution vector at the end of the presently converged time-step, each
+		// process writing the entries of the dofs it owns
+		std::vector<int64_t> owned_dofs (locally_owned_dofs.n_elements());
+		for (unsigned int i=0; i<owned_dofs.size(); ++i)
+			owned_dofs[i] = locally_owned_dofs.nth_index_in_set(i);
+
+		sprintf(filename, "%s/lcts.solution.bin", macrostatelocres.c_str());
+		write_checkpoint_vector(filename, displacement.begin(), displacement.size(), owned_dofs, FE_communicator);
+
+		sprintf(filename, "%s/lcts.velocity.bin", macrostatelocres.c_str());
+		write_checkpoint_vector(filename, velocity.begin(), velocity.size(), owned_dofs, FE_communicator);
+
+		// Output of the last converged timestep quadrature local history, as (update strain, stress)
+		// records placed by global quadrature point id, independently of the processors layout
+		const unsigned int n_components = SymmetricTensor<2,dim>::n_independent_components;
+		std::vector<double> lhistory;
+		std::vector<int64_t> qpids (quadrature_point_history.size());
+		lhistory.reserve(quadrature_point_history.size()*2*n_components);
+		for (unsigned int k=0; k<quadrature_point_history.size(); ++k)
 		{
-			// Write solution vector to binary for simulation restart
-			const std::string solution_filename = (macrostatelocres + "/lcts.solution.bin");
-			std::ofstream ofile(solution_filename);
-			displacement.block_write(ofile);
-			ofile.close();
-
-			const std::string solution_filename_veloc = (macrostatelocres + "/lcts.velocity.bin");
-			std::ofstream ofile_veloc(solution_filename_veloc);
-			velocity.block_write(ofile_veloc);
-			ofile_veloc.close();
+			qpids[k] = quadrature_point_history.qpid[k];
+			for (unsigned int i=0; i<n_components; ++i)
+				lhistory.push_back(quadrature_point_history.upd_strain[k].access_raw_entry(i));
+			for (unsigned int i=0; i<n_components; ++i)
+				lhistory.push_back(quadrature_point_history.new_stress[k].access_raw_entry(i));
 		}
-		MPI_Barrier(FE_communicator);
-
-		// Output of the last converged timestep quadrature local history per processor
-		sprintf(filename, "%s/lcts.pr_%d.lhistory.bin", macrostatelocres.c_str(), this_FE_process);
-		std::ofstream  lhprocoutbin(filename, std::ios_base::binary);
-
-		// Output of complete local history in a single file per processor
-		for (typename DoFHandler<dim>::active_cell_iterator
-				cell = dof_handler.begin_active();
-				cell != dof_handler.end(); ++cell)
-			if (cell->is_locally_owned())
-			{
-				char cell_id[1024]; sprintf(cell_id, "%d", cell->active_cell_index());
-
-				PointHistory<dim> *local_qp_hist
-				= reinterpret_cast<PointHistory<dim> *>(cell->user_pointer());
 
-				// Save strain, updstrain, stress history in one file per proc
-				for (unsigned int q=0; q<quadrature_formula.size(); ++q)
-				{
-					lhprocoutbin << present_time
-							<< "," << cell->active_cell_index()
-							<< "," << q
-							<< "," << local_qp_hist[q].mat.c_str();
-					for(unsigned int k=0;k<dim;k++)
-						for(unsigned int l=k;l<dim;l++){
-							lhprocoutbin << "," << std::setprecision(16) << local_qp_hist[q].upd_strain[k][l];
-						}
-					for(unsigned int k=0;k<dim;k++)
-						for(unsigned int l=k;l<dim;l++){
-							lhprocoutbin << "," << std::setprecision(16) << local_qp_hist[q].new_stress[k][l];
-						}
-					lhprocoutbin << std::endl;
-				}
-			}
-		lhprocoutbin.close();
-		MPI_Barrier(FE_communicator);
+		sprintf(filename, "%s/lcts.lhistory.bin", macrostatelocres.c_str());
+		write_checkpoint_records(filename, lhistory, 2*n_components, qpids,
+				int64_t(triangulation.n_active_cells())*quadrature_formula.size(), FE_communicator);
 	}
 
 
@@ -2381,6 +2038,12 @@ namespace HMM
 		dcout << " Initiation of the Mesh...       " << std::endl;
 		make_grid ();
 
+		// Setting up the computation of the velocity update from the lumped mass, instead of the CG solver
+		use_lumped_mass = input_config.get<bool>("continuum time.lumped mass", false);
+
+		// Setting up the number of threads running the cell loops of each FE process
+		MultithreadInfo::set_thread_limit(input_config.get<int>("computational resources.threads per fem process", 1));
+
 		dcout << " Initiation of the global vectors and tensor...       " << std::endl;
 		setup_system ();
 
@@ -2430,7 +2093,8 @@ namespace HMM
 		dcout << "    Solving FE system..." << std::flush;
 
 		// Solving for the update of the increment of velocity
-		solve_linear_problem_CG();
+		if(use_lumped_mass) solve_lumped_mass();
+		else solve_linear_problem_CG();
 
 		// Updating incremental variables
 		update_incremental_variables();
@@ -2439,8 +2103,6 @@ namespace HMM
 		dcout << "    Updating quadrature point data..." << std::endl;
 
 		update_strain_quadrature_point_history(newton_update_displacement);
-
-		check_strain_quadrature_point_history();
 		history_analysis();
 
 		MPI_Barrier(FE_communicator);
@@ -2451,10 +2113,12 @@ namespace HMM
 
 
 	template <int dim>
-	bool FEProblem<dim>::check (ScaleBridgingData scale_bridging_data){
+	bool FEProblem<dim>::check (ScaleBridgingData &scale_bridging_data){
 		double previous_res;
 
-		update_stress_quadrature_point_history (newton_update_displacement, scale_bridging_data);
+		// The quadrature points look up the stress of the update they get their results from
+		scale_bridging_data.build_stress_index();
+		update_stress_quadrature_point_history (scale_bridging_data);
 					
 
 		dcout << "    Re-assembling FE system..." << std::flush;
@@ -2481,13 +2145,36 @@ namespace HMM
 
 
 	template <int dim>
-	void FEProblem<dim>::endstep (){
+	void FEProblem<dim>::endstep (bool defer_outputs){
 
 		// Updating the total displacement and velocity vectors
 		velocity+=incremental_velocity;
 		displacement+=incremental_displacement;
 		//old_displacement=displacement;
 
+		if (defer_outputs){
+			// Snapshot of the quadrature point history (the only output data modified
+			// by the next solve), outputs are then written while the MD simulations of
+			// the next timestep are running
+			if(timestep%freq_output_lbcforce==0 || timestep%freq_output_lhist==0
+					|| timestep%freq_output_visu==0 || timestep%freq_checkpoint==0){
+				output_quadrature_point_history.copy_output_fields(quadrature_point_history);
+				output_internal_forces = internal_forces;
+				output_timestep = timestep;
+				output_present_time = present_time;
+				pending_outputs = true;
+			}
+		}
+		else write_outputs ();
+
+        dcout << std::endl;
+    }
+
+
+
+	template <int dim>
+	void FEProblem<dim>::write_outputs (){
+
 		// Outputs
 		output_results ();
 
@@ -2497,8 +2184,30 @@ namespace HMM
 			//char timeid[1024];
 			checkpoint();
        }
+	}
 
-        dcout << std::endl;
-    }
+
+
+	// Writing the outputs of the previous timestep, swapping its converged state in
+	// place of the current one (outputs read quadrature_point_history)
+	template <int dim>
+	void FEProblem<dim>::flush_outputs (){
+
+		if (!pending_outputs) return;
+
+		quadrature_point_history.swap_output_fields(output_quadrature_point_history);
+		internal_forces.swap(output_internal_forces);
+		std::swap(timestep, output_timestep);
+		std::swap(present_time, output_present_time);
+
+		write_outputs ();
+
+		quadrature_point_history.swap_output_fields(output_quadrature_point_history);
+		internal_forces.swap(output_internal_forces);
+		std::swap(timestep, output_timestep);
+		std::swap(present_time, output_present_time);
+
+		pending_outputs = false;
+	}
 }
-#endif    
+#endif
@@ -0,0 +1,102 @@
+#ifndef MD_SAMPLE_LOG_H
+#define MD_SAMPLE_LOG_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+
+namespace HMM {
+
+	// Header of the record of a MD run in a sample log, followed by the strain applied
+	// (n_components values) and the stress samples (n_samples*n_components values)
+	struct MDSampleRecordHeader
+	{
+		int32_t		qp_id;
+		int32_t		replica;
+		int32_t		n_samples;
+		int32_t		n_components;
+		char		matid[16];
+		char		time_id[16];
+		char		force_field[16];
+		double		temperature;
+		double		strain_rate;
+	};
+
+	// Entry of the index of a sample log, locating the record of a MD run
+	struct MDSampleIndexEntry
+	{
+		int32_t		qp_id;
+		int32_t		replica;
+		char		time_id[16];
+		int64_t		offset;
+	};
+
+	// Append-only binary log of the stress samples of the MD runs executed by a batch,
+	// along with its index (<filename>.index). Both files are kept open for the lifetime
+	// of the batch, and only written by its root process.
+	class MDSampleLog
+	{
+		public:
+			~MDSampleLog()
+			{
+				close();
+			}
+
+			void open(std::string filename)
+			{
+				if (log_filename == filename) return;
+				close();
+
+				std::ifstream existing_log(filename.c_str(), std::ios::binary | std::ios::ate);
+				offset = existing_log.is_open() ? int64_t(existing_log.tellg()) : 0;
+				existing_log.close();
+
+				log.open(filename.c_str(), std::ios::binary | std::ios::app);
+				index.open((filename + ".index").c_str(), std::ios::binary | std::ios::app);
+				if (!log.is_open() || !index.is_open()){
+					std::cerr << "Unable to open " << filename << " to write MD samples in it" << std::endl;
+					exit(1);
+				}
+				log_filename = filename;
+			}
+
+			void append(const MDSampleRecordHeader &header, const std::vector<double> &strain,
+					const std::vector<double> &samples)
+			{
+				MDSampleIndexEntry entry;
+				entry.qp_id = header.qp_id;
+				entry.replica = header.replica;
+				memcpy(entry.time_id, header.time_id, sizeof(entry.time_id));
+				entry.offset = offset;
+
+				log.write((char *) &header, sizeof(MDSampleRecordHeader));
+				log.write((char *) strain.data(), strain.size()*sizeof(double));
+				log.write((char *) samples.data(), samples.size()*sizeof(double));
+				log.flush();
+				index.write((char *) &entry, sizeof(MDSampleIndexEntry));
+				index.flush();
+
+				offset += sizeof(MDSampleRecordHeader) + (strain.size() + samples.size())*sizeof(double);
+			}
+
+			void close()
+			{
+				if (log.is_open()) log.close();
+				if (index.is_open()) index.close();
+				log_filename.clear();
+			}
+
+		private:
+			std::ofstream	log;
+			std::ofstream	index;
+			std::string	log_filename;
+			int64_t		offset;
+	};
+}
+
+#endif
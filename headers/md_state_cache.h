@@ -0,0 +1,210 @@
+#ifndef MD_STATE_CACHE_H
+#define MD_STATE_CACHE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <string>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+
+namespace HMM {
+
+	// Atomistic state of a replica box at the end of its last straining, namely
+	// everything that changes during a NEMD run of a given topology (the topology
+	// itself is kept by the LAMMPS engine, or reloaded from the init.<mat>_<repl>.bin
+	// restart file when the engine switches to another replica)
+	struct MDState
+	{
+		double 			boxlo[3];
+		double 			boxhi[3];
+		double 			tilt[3]; // xy, xz, yz
+
+		std::vector<double>	x;
+		std::vector<double>	v;
+		std::vector<int>	image;
+
+		int natoms() const
+		{
+			return x.size()/3;
+		}
+	};
+
+	// Binary dump of a state (header with the number of atoms and the box,
+	// followed by the positions, velocities and image flags arrays)
+	inline bool write_md_state (const char *filename, const MDState &md_state)
+	{
+		std::ofstream ofile(filename, std::ios::binary | std::ios::trunc);
+		if (!ofile.is_open()){
+			std::cerr << "Unable to open " << filename << " to write MD state in it" << std::endl;
+			return false;
+		}
+
+		int natoms = md_state.natoms();
+		ofile.write((char *) &natoms, sizeof(int));
+		ofile.write((char *) md_state.boxlo, 3*sizeof(double));
+		ofile.write((char *) md_state.boxhi, 3*sizeof(double));
+		ofile.write((char *) md_state.tilt, 3*sizeof(double));
+		ofile.write((char *) md_state.x.data(), 3*natoms*sizeof(double));
+		ofile.write((char *) md_state.v.data(), 3*natoms*sizeof(double));
+		ofile.write((char *) md_state.image.data(), natoms*sizeof(int));
+		ofile.close();
+
+		return true;
+	}
+
+	inline bool read_md_state (const char *filename, MDState &md_state)
+	{
+		std::ifstream ifile(filename, std::ios::binary);
+		if (!ifile.is_open()) return false;
+
+		int natoms = 0;
+		ifile.read((char *) &natoms, sizeof(int));
+		if (!ifile.good() || natoms < 0) return false;
+		ifile.read((char *) md_state.boxlo, 3*sizeof(double));
+		ifile.read((char *) md_state.boxhi, 3*sizeof(double));
+		ifile.read((char *) md_state.tilt, 3*sizeof(double));
+
+		md_state.x.resize(3*natoms);
+		md_state.v.resize(3*natoms);
+		md_state.image.resize(natoms);
+		ifile.read((char *) md_state.x.data(), 3*natoms*sizeof(double));
+		ifile.read((char *) md_state.v.data(), 3*natoms*sizeof(double));
+		ifile.read((char *) md_state.image.data(), natoms*sizeof(int));
+
+		bool read_ok = ifile.good();
+		ifile.close();
+
+		return read_ok;
+	}
+
+	// Flattened state, as doubles, to be sent to another process (number of atoms and
+	// box, followed by the positions, velocities and image flags arrays)
+	inline void pack_md_state (const MDState &md_state, std::vector<double> &buffer)
+	{
+		int natoms = md_state.natoms();
+		buffer.clear();
+		buffer.reserve(10 + 7*natoms);
+		buffer.push_back(natoms);
+		buffer.insert(buffer.end(), md_state.boxlo, md_state.boxlo+3);
+		buffer.insert(buffer.end(), md_state.boxhi, md_state.boxhi+3);
+		buffer.insert(buffer.end(), md_state.tilt, md_state.tilt+3);
+		buffer.insert(buffer.end(), md_state.x.begin(), md_state.x.end());
+		buffer.insert(buffer.end(), md_state.v.begin(), md_state.v.end());
+		buffer.insert(buffer.end(), md_state.image.begin(), md_state.image.end());
+	}
+
+	inline void unpack_md_state (const double *buffer, MDState &md_state)
+	{
+		int natoms = int(buffer[0]);
+		for (int k=0; k<3; k++){
+			md_state.boxlo[k] = buffer[1+k];
+			md_state.boxhi[k] = buffer[4+k];
+			md_state.tilt[k] = buffer[7+k];
+		}
+		md_state.x.assign(buffer+10, buffer+10+3*natoms);
+		md_state.v.assign(buffer+10+3*natoms, buffer+10+6*natoms);
+		md_state.image.assign(buffer+10+6*natoms, buffer+10+7*natoms);
+	}
+
+	// Cache of the atomistic states computed by a batch of MD processes, keyed by
+	// (qp_id, material, replica). Only held by the root process of the batch. States
+	// are kept in memory, or in a node-local directory if a spill directory is given.
+	class MDStateCache
+	{
+		public:
+			typedef std::tuple<int,int,int> Key;
+
+			MDStateCache()
+			{
+				spill_directory = "none";
+			}
+
+			~MDStateCache()
+			{
+				clear();
+			}
+
+			void set_spill_directory(std::string directory)
+			{
+				spill_directory = directory;
+			}
+
+			bool has(int qp_id, int material, int replica) const
+			{
+				return index.count(Key(qp_id, material, replica)) > 0;
+			}
+
+			void store(int qp_id, int material, int replica, const MDState &md_state)
+			{
+				Key key(qp_id, material, replica);
+				index[key] = true;
+				if (spill_directory == "none"){
+					states[key] = md_state;
+				}
+				else {
+					write_md_state(spilled_filename(key).c_str(), md_state);
+				}
+			}
+
+			bool load(int qp_id, int material, int replica, MDState &md_state) const
+			{
+				Key key(qp_id, material, replica);
+				if (index.count(key) == 0) return false;
+
+				if (spill_directory == "none"){
+					md_state = states.at(key);
+					return true;
+				}
+				else return read_md_state(spilled_filename(key).c_str(), md_state);
+			}
+
+			void evict(int qp_id, int material, int replica)
+			{
+				Key key(qp_id, material, replica);
+				if (index.count(key) == 0) return;
+
+				if (spill_directory == "none") states.erase(key);
+				else remove(spilled_filename(key).c_str());
+				index.erase(key);
+			}
+
+			void clear()
+			{
+				if (spill_directory != "none")
+					for (std::map<Key,bool>::const_iterator it = index.begin(); it != index.end(); ++it)
+						remove(spilled_filename(it->first).c_str());
+				states.clear();
+				index.clear();
+			}
+
+			// Flattened list of the cached keys (qp_id, material, replica, ...)
+			std::vector<int> keys() const
+			{
+				std::vector<int> flat_keys;
+				for (std::map<Key,bool>::const_iterator it = index.begin(); it != index.end(); ++it){
+					flat_keys.push_back(std::get<0>(it->first));
+					flat_keys.push_back(std::get<1>(it->first));
+					flat_keys.push_back(std::get<2>(it->first));
+				}
+				return flat_keys;
+			}
+
+		private:
+			std::string spilled_filename(const Key &key) const
+			{
+				return spill_directory + "/cache." + std::to_string(std::get<0>(key))
+						+ "." + std::to_string(std::get<1>(key))
+						+ "_" + std::to_string(std::get<2>(key)) + ".state";
+			}
+
+			std::map<Key,MDState>	states;
+			std::map<Key,bool>	index;
+			std::string		spill_directory;
+	};
+}
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef MPI_CHECKPOINT_H
+#define MPI_CHECKPOINT_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <iostream>
+
+#include <mpi.h>
+
+namespace HMM {
+
+	// Header of the binary checkpoint files, followed by the records ordered by their global
+	// key (dof index, quadrature point id), which makes them independent of the partition of
+	// the processes that wrote them. All accesses are collective with MPI-IO
+	struct CheckpointHeader
+	{
+		int32_t		magic;
+		int32_t		version;
+		int32_t		n_processes; // number of processes that wrote the file
+		int32_t		record_size; // number of doubles per record
+		int64_t		n_records;
+	};
+
+	const int32_t checkpoint_magic = 0x504d4c44; // "DLMP"
+	const int32_t checkpoint_version = 2;
+
+	inline bool open_checkpoint (const char *filename, int amode, MPI_Comm communicator, MPI_File &fh)
+	{
+		char mpi_filename[1024]; sprintf(mpi_filename, "%s", filename);
+		return MPI_File_open(communicator, mpi_filename, amode, MPI_INFO_NULL, &fh) == MPI_SUCCESS;
+	}
+
+	inline bool read_checkpoint_header (MPI_File &fh, const char *filename, int record_size, int64_t n_records)
+	{
+		CheckpointHeader header;
+		MPI_File_read_at_all(fh, 0, &header, sizeof(CheckpointHeader), MPI_BYTE, MPI_STATUS_IGNORE);
+		if (header.magic != checkpoint_magic || header.version != checkpoint_version){
+			std::cerr << "Unrecognized format of the checkpoint file " << filename << std::endl;
+			return false;
+		}
+		if (header.n_records != n_records || header.record_size != record_size){
+			std::cerr << "Checkpoint file " << filename << " holds " << header.n_records << " records of "
+					<< header.record_size << " values, instead of " << n_records << " records of "
+					<< record_size << " values" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// File view over the records of the given keys, along with the position of these
+	// records in the local buffer once sorted by key
+	inline MPI_Datatype create_checkpoint_view (const std::vector<int64_t> &keys, int record_size,
+			std::vector<size_t> &sorted_positions)
+	{
+		sorted_positions.resize(keys.size());
+		for (size_t i=0; i<keys.size(); i++) sorted_positions[i] = i;
+		std::sort(sorted_positions.begin(), sorted_positions.end(),
+				[&keys](size_t a, size_t b){ return keys[a] < keys[b]; });
+
+		std::vector<MPI_Aint> displs (keys.size());
+		for (size_t i=0; i<keys.size(); i++)
+			displs[i] = MPI_Aint(keys[sorted_positions[i]])*record_size*sizeof(double);
+
+		MPI_Datatype view_type;
+		MPI_Type_create_hindexed_block(keys.size(), record_size, displs.data(), MPI_DOUBLE, &view_type);
+		MPI_Type_commit(&view_type);
+		return view_type;
+	}
+
+	// Records of the keys held by each process, out of the n_records of the whole problem
+	inline void write_checkpoint_records (const char *filename, const std::vector<double> &records,
+			int record_size, const std::vector<int64_t> &keys, int64_t n_records, MPI_Comm communicator)
+	{
+		int this_process, n_processes;
+		MPI_Comm_rank(communicator, &this_process);
+		MPI_Comm_size(communicator, &n_processes);
+
+		MPI_File fh;
+		if (!open_checkpoint(filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, communicator, fh)){
+			std::cerr << "Unable to open " << filename << " to write checkpoint in it" << std::endl;
+			exit(1);
+		}
+		MPI_File_set_size(fh, 0);
+
+		if (this_process == 0){
+			CheckpointHeader header = {checkpoint_magic, checkpoint_version, n_processes, record_size, n_records};
+			MPI_File_write_at(fh, 0, &header, sizeof(CheckpointHeader), MPI_BYTE, MPI_STATUS_IGNORE);
+		}
+
+		std::vector<size_t> sorted_positions;
+		MPI_Datatype view_type = create_checkpoint_view(keys, record_size, sorted_positions);
+
+		std::vector<double> sorted_records (records.size());
+		for (size_t i=0; i<sorted_positions.size(); i++)
+			std::copy(records.begin() + sorted_positions[i]*record_size,
+					records.begin() + (sorted_positions[i]+1)*record_size,
+					sorted_records.begin() + i*record_size);
+
+		char native[] = "native";
+		MPI_File_set_view(fh, sizeof(CheckpointHeader), MPI_DOUBLE, view_type, native, MPI_INFO_NULL);
+		MPI_File_write_all(fh, sorted_records.data(), sorted_records.size(), MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+		MPI_Type_free(&view_type);
+		MPI_File_close(&fh);
+	}
+
+	// Records of the given keys, whatever the number of processes that wrote the checkpoint
+	inline bool read_checkpoint_records (const char *filename, std::vector<double> &records,
+			int record_size, const std::vector<int64_t> &keys, int64_t n_records, MPI_Comm communicator)
+	{
+		MPI_File fh;
+		if (!open_checkpoint(filename, MPI_MODE_RDONLY, communicator, fh)) return false;
+
+		if (!read_checkpoint_header(fh, filename, record_size, n_records)){
+			MPI_File_close(&fh);
+			return false;
+		}
+
+		std::vector<size_t> sorted_positions;
+		MPI_Datatype view_type = create_checkpoint_view(keys, record_size, sorted_positions);
+
+		std::vector<double> sorted_records (keys.size()*record_size);
+		char native[] = "native";
+		MPI_File_set_view(fh, sizeof(CheckpointHeader), MPI_DOUBLE, view_type, native, MPI_INFO_NULL);
+		MPI_File_read_all(fh, sorted_records.data(), sorted_records.size(), MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+		records.resize(keys.size()*record_size);
+		for (size_t i=0; i<sorted_positions.size(); i++)
+			std::copy(sorted_records.begin() + i*record_size,
+					sorted_records.begin() + (i+1)*record_size,
+					records.begin() + sorted_positions[i]*record_size);
+
+		MPI_Type_free(&view_type);
+		MPI_File_close(&fh);
+		return true;
+	}
+
+	// Vector replicated on all the processes, each of them writing the entries it owns
+	inline void write_checkpoint_vector (const char *filename, const double *values, int64_t n_values,
+			const std::vector<int64_t> &owned_entries, MPI_Comm communicator)
+	{
+		std::vector<double> owned_values (owned_entries.size());
+		for (size_t i=0; i<owned_entries.size(); i++) owned_values[i] = values[owned_entries[i]];
+
+		write_checkpoint_records(filename, owned_values, 1, owned_entries, n_values, communicator);
+	}
+
+	// The whole vector is read by every process
+	inline bool read_checkpoint_vector (const char *filename, double *values, int64_t n_values,
+			MPI_Comm communicator)
+	{
+		MPI_File fh;
+		if (!open_checkpoint(filename, MPI_MODE_RDONLY, communicator, fh)) return false;
+
+		bool read_ok = read_checkpoint_header(fh, filename, 1, n_values);
+		if (read_ok)
+			MPI_File_read_at_all(fh, sizeof(CheckpointHeader), values, n_values, MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+		MPI_File_close(&fh);
+		return read_ok;
+	}
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef QP_TIMESERIES_H
+#define QP_TIMESERIES_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+
+#include <mpi.h>
+
+namespace HMM {
+
+	// Append-only columnar store of quadrature point fields. The file starts with a header
+	// (number of columns and quadrature points, followed by the column names), then holds one
+	// chunk per output step, each chunk storing every column as a contiguous array of doubles
+	// ordered by quadrature point id. The timestep, time and offset of each chunk are listed in
+	// a companion index file (<filename>.index).
+	struct QPTimeSeriesHeader
+	{
+		int32_t		magic;
+		int32_t		version;
+		int32_t		n_columns;
+		int32_t		column_name_length;
+		int64_t		n_qp;
+	};
+
+	struct QPTimeSeriesIndexEntry
+	{
+		int64_t		timestep;
+		double		time;
+		int64_t		offset;
+	};
+
+	const int32_t qp_timeseries_magic = 0x53545051; // "QPTS"
+	const int32_t qp_timeseries_version = 1;
+	const int32_t qp_timeseries_name_length = 16;
+
+	// Appending a chunk, each process providing the columns of the quadrature points it owns
+	// (columns[c*keys.size() + k] being the value of column c for quadrature point keys[k])
+	inline void append_qp_timeseries_chunk (const char *filename, int timestep, double time,
+			const std::vector<std::string> &column_names, const std::vector<double> &columns,
+			const std::vector<int64_t> &keys, int64_t n_qp, MPI_Comm communicator)
+	{
+		int this_process;
+		MPI_Comm_rank(communicator, &this_process);
+
+		const int32_t n_columns = column_names.size();
+		const size_t n_local_qp = keys.size();
+
+		char mpi_filename[1024]; sprintf(mpi_filename, "%s", filename);
+		MPI_File fh;
+		if (MPI_File_open(communicator, mpi_filename, MPI_MODE_CREATE | MPI_MODE_RDWR,
+				MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+			std::cerr << "Unable to open " << filename << " to write quadrature point data in it" << std::endl;
+			exit(1);
+		}
+
+		const MPI_Offset header_size = sizeof(QPTimeSeriesHeader) + n_columns*qp_timeseries_name_length;
+		const MPI_Offset chunk_size = MPI_Offset(n_columns)*n_qp*sizeof(double);
+
+		MPI_Offset file_size;
+		MPI_File_get_size(fh, &file_size);
+
+		// The header is written along with the first chunk, otherwise the chunk is appended
+		// after the last complete one (in case of a restart, the chunks of the timesteps replayed
+		// are written again and superseded in the index)
+		MPI_Offset chunk_offset = header_size;
+		if (file_size < header_size){
+			if (this_process == 0){
+				QPTimeSeriesHeader header = {qp_timeseries_magic, qp_timeseries_version, n_columns,
+						qp_timeseries_name_length, n_qp};
+				std::vector<char> names (n_columns*qp_timeseries_name_length, '\0');
+				for (int32_t c=0; c<n_columns; c++)
+					strncpy(&names[c*qp_timeseries_name_length], column_names[c].c_str(), qp_timeseries_name_length-1);
+				MPI_File_write_at(fh, 0, &header, sizeof(QPTimeSeriesHeader), MPI_BYTE, MPI_STATUS_IGNORE);
+				MPI_File_write_at(fh, sizeof(QPTimeSeriesHeader), &names[0], names.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+			}
+		}
+		else {
+			QPTimeSeriesHeader header;
+			MPI_File_read_at_all(fh, 0, &header, sizeof(QPTimeSeriesHeader), MPI_BYTE, MPI_STATUS_IGNORE);
+			if (header.magic != qp_timeseries_magic || header.version != qp_timeseries_version
+					|| header.n_columns != n_columns || header.n_qp != n_qp){
+				std::cerr << "Quadrature point data file " << filename << " was written with another format or mesh" << std::endl;
+				exit(1);
+			}
+			chunk_offset += ((file_size - header_size)/chunk_size)*chunk_size;
+		}
+
+		// Local quadrature points sorted by id, as required by the file view
+		std::vector<size_t> sorted_positions (n_local_qp);
+		for (size_t k=0; k<n_local_qp; k++) sorted_positions[k] = k;
+		std::sort(sorted_positions.begin(), sorted_positions.end(),
+				[&keys](size_t a, size_t b){ return keys[a] < keys[b]; });
+
+		std::vector<MPI_Aint> displs (n_local_qp);
+		for (size_t k=0; k<n_local_qp; k++) displs[k] = MPI_Aint(keys[sorted_positions[k]])*sizeof(double);
+
+		std::vector<double> sorted_columns (columns.size());
+		for (int32_t c=0; c<n_columns; c++)
+			for (size_t k=0; k<n_local_qp; k++)
+				sorted_columns[c*n_local_qp + k] = columns[c*n_local_qp + sorted_positions[k]];
+
+		// The view over the positions of the local quadrature points in a column is tiled
+		// over the successive columns of the chunk
+		MPI_Datatype qp_type, column_type;
+		MPI_Type_create_hindexed_block(n_local_qp, 1, displs.data(), MPI_DOUBLE, &qp_type);
+		MPI_Type_create_resized(qp_type, 0, n_qp*sizeof(double), &column_type);
+		MPI_Type_commit(&column_type);
+
+		char native[] = "native";
+		MPI_File_set_view(fh, chunk_offset, MPI_DOUBLE, column_type, native, MPI_INFO_NULL);
+		MPI_File_write_all(fh, sorted_columns.data(), sorted_columns.size(), MPI_DOUBLE, MPI_STATUS_IGNORE);
+
+		MPI_Type_free(&qp_type);
+		MPI_Type_free(&column_type);
+		MPI_File_close(&fh);
+
+		if (this_process == 0){
+			QPTimeSeriesIndexEntry entry = {timestep, time, chunk_offset};
+			std::string index_filename = std::string(filename) + ".index";
+			std::ofstream index_file(index_filename.c_str(), std::ios_base::binary | std::ios_base::app);
+			index_file.write((char *) &entry, sizeof(QPTimeSeriesIndexEntry));
+			index_file.close();
+		}
+	}
+}
+
+#endif
@@ -4,6 +4,9 @@
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <iostream>
 #include <stdint.h>
 #include <fstream>
 #include <math.h>
@@ -18,16 +21,173 @@ namespace HMM {
 		double	update_stress[6];
 	};
 
+	struct QPStress // stress returned to a quadrature point
+	{
+		int 	id;
+		double	update_stress[6];
+	};
+
+	struct QPDescriptor // quadrature point update, as needed to plan its MD runs
+	{
+		int 	id;
+		int   	most_recent_id;
+		int 	material;
+		double	strain_norm;
+	};
+
+	// Position of records in a list given their (unique) key, built once per list and then
+	// searched by bisection
+	class KeyIndex
+	{
+		public:
+			void build (const std::vector<int64_t> &keys)
+			{
+				key_positions.resize(keys.size());
+				for (size_t i=0; i<keys.size(); i++)
+					key_positions[i] = std::make_pair(keys[i], int(i));
+				std::sort(key_positions.begin(), key_positions.end());
+			}
+
+			// Position of the record with the given key, -1 if there is none
+			int find (int64_t key) const
+			{
+				std::vector<std::pair<int64_t,int> >::const_iterator it =
+						std::lower_bound(key_positions.begin(), key_positions.end(),
+								std::make_pair(key, -1));
+				if (it == key_positions.end() || it->first != key) return -1;
+				return it->second;
+			}
+
+		private:
+			std::vector<std::pair<int64_t,int> > key_positions;
+	};
+
 	struct ScaleBridgingData
 	{
+		// Updates of this FE process, replaced on the root of each MD batch by the updates
+		// the batch runs
 		std::vector<QP>	update_list;
+
+		// Index of update_list by quadrature point id, to be rebuilt when update_list is replaced
+		KeyIndex		update_index;
+
+		void build_update_index ()
+		{
+			std::vector<int64_t> ids (update_list.size());
+			for (size_t i=0; i<update_list.size(); i++) ids[i] = update_list[i].id;
+			update_index.build(ids);
+		}
+
+		const QP& get_qp_with_id (int qp_id) const
+		{
+			int i = update_index.find(qp_id);
+			if (i < 0){
+				std::cout << "Error: No QP objecr with id "<< qp_id << std::endl;
+				exit(1);
+			}
+			return update_list[i];
+		}
+
+		// Description of the updates of all the FE processes, held by the MD processes to plan
+		// the MD runs, and the MD process (rank in the MD communicator) at the root of the batch
+		// running each MD run, ordered by update then by replica
+		std::vector<QPDescriptor>	update_descriptors;
+		KeyIndex		descriptor_index;
+		std::vector<int> run_processes;
+
+		void build_descriptor_index ()
+		{
+			std::vector<int64_t> ids (update_descriptors.size());
+			for (size_t i=0; i<update_descriptors.size(); i++) ids[i] = update_descriptors[i].id;
+			descriptor_index.build(ids);
+		}
+
+		int get_descriptor_position (int qp_id) const
+		{
+			int i = descriptor_index.find(qp_id);
+			if (i < 0){
+				std::cout << "Error: No MD run planned for the requested QP with id "<< qp_id << std::endl;
+				exit(1);
+			}
+			return i;
+		}
+
+		// Ids of the updates the quadrature points of this FE process get their stress from
+		std::vector<int> requested_ids;
+
+		// Requests routed to the root of the batch running the requested updates: id and
+		// world rank of the requesting FE process
+		std::vector<int> routed_ids;
+		std::vector<int> routed_processes;
+
+		// Contributions of the MD runs of the batch to the stresses averaged over the replicas,
+		// only held by the root of the batch
+		std::vector<QPStress>	replica_stress_list;
+
+		// Stresses of the requested updates, as returned to this FE process
+		std::vector<QPStress>	stress_list;
+		KeyIndex		stress_index;
+
+		void build_stress_index ()
+		{
+			std::vector<int64_t> ids (stress_list.size());
+			for (size_t i=0; i<stress_list.size(); i++) ids[i] = stress_list[i].id;
+			stress_index.build(ids);
+		}
+
+		const QPStress& get_stress_with_id (int qp_id) const
+		{
+			int i = stress_index.find(qp_id);
+			if (i < 0){
+				std::cout << "Error: No stress returned for QP with id "<< qp_id << std::endl;
+				exit(1);
+			}
+			return stress_list[i];
+		}
 	};
 
 	MPI_Datatype MPI_QP;
+	MPI_Datatype MPI_QP_STRESS;
+	MPI_Datatype MPI_QP_DESCRIPTOR;
 	void create_qp_mpi_datatype()
 	{
     MPI_Type_contiguous(sizeof(QP), MPI_BYTE, &MPI_QP);
     MPI_Type_commit(&MPI_QP);
+    MPI_Type_contiguous(sizeof(QPStress), MPI_BYTE, &MPI_QP_STRESS);
+    MPI_Type_commit(&MPI_QP_STRESS);
+    MPI_Type_contiguous(sizeof(QPDescriptor), MPI_BYTE, &MPI_QP_DESCRIPTOR);
+    MPI_Type_commit(&MPI_QP_DESCRIPTOR);
+	}
+
+	// Exchange of records between the processes of a communicator, where each process only
+	// sends records[p] to process p, returning the records received ordered by sender
+	template <typename T>
+	std::vector<T> exchange_records (const std::vector<std::vector<T> > &records,
+			MPI_Datatype datatype, MPI_Comm communicator)
+	{
+		int n_processes;
+		MPI_Comm_size(communicator, &n_processes);
+
+		std::vector<T> send_records;
+		std::vector<int> send_counts (n_processes, 0);
+		std::vector<int> send_displs (n_processes, 0);
+		for (int p=0; p<n_processes; p++){
+			send_counts[p] = records[p].size();
+			send_displs[p] = send_records.size();
+			send_records.insert(send_records.end(), records[p].begin(), records[p].end());
+		}
+
+		std::vector<int> recv_counts (n_processes, 0);
+		MPI_Alltoall(&send_counts[0], 1, MPI_INT, &recv_counts[0], 1, MPI_INT, communicator);
+
+		std::vector<int> recv_displs (n_processes, 0);
+		for (int p=1; p<n_processes; p++) recv_displs[p] = recv_displs[p-1] + recv_counts[p-1];
+
+		std::vector<T> recv_records (recv_displs[n_processes-1] + recv_counts[n_processes-1]);
+		MPI_Alltoallv(send_records.data(), &send_counts[0], &send_displs[0], datatype,
+				recv_records.data(), &recv_counts[0], &recv_displs[0], datatype, communicator);
+
+		return recv_records;
 	}
 }
 
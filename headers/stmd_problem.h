@@ -6,6 +6,7 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <map>
 #include <sys/stat.h>
 #include <math.h>
 
@@ -25,6 +26,8 @@
 
 // Specifically built header files
 #include "md_sim.h"
+#include "md_state_cache.h"
+#include "md_sample_log.h"
 #include "read_write.h"
 #include "stmd_sync.h"
 
@@ -40,12 +43,19 @@ template <int dim>
 class STMDProblem
 {
 public:
-	STMDProblem (MPI_Comm mdcomm, int pcolorr);
+	STMDProblem (MPI_Comm mdcomm, int pcolorr, MDStateCache *mdcache, std::string mdlocaldir);
 	~STMDProblem ();
 	void strain (MDSim<dim>& md_sim, bool approx_md_with_hookes_law);
 
 private:
 
+	void set_job_variables(MDSim<dim> md_sim, bool store_log);
+	void load_topology(MDSim<dim> md_sim, const char *restartfile, bool initial_topology);
+	void gather_md_state(MDState& md_state);
+	void scatter_md_state(MDState& md_state);
+	bool broadcast_md_state(bool found, MDState& md_state);
+	bool load_md_state(MDSim<dim> md_sim, int load_qp_id, MDState& md_state);
+	bool load_initial_md_state(MDSim<dim> md_sim, MDState& md_state);
 	SymmetricTensor<2,dim> lammps_straining(MDSim<dim> md_sim);
 	SymmetricTensor<2,dim> stress_from_hookes_law (SymmetricTensor<2,dim> strain, SymmetricTensor<4,dim> stiffness);
 
@@ -54,25 +64,254 @@ private:
 	const int 							this_md_batch_process;
 	int 								md_batch_pcolor;
 
+	// LAMMPS engine kept alive for the whole lifetime of the batch, along with the
+	// topology and force field it holds, which are only reset with 'clear' when the
+	// next MD job runs on another material, replica or force field
+	LAMMPS								*lmp = NULL;
+	std::string							loaded_matid;
+	int									loaded_replica = 0;
+	std::string							loaded_force_field;
+
+	// Initial state of the topologies loaded by this engine, to restart the MD jobs
+	// without a computed state from (only held by its root process)
+	std::map<std::string, MDState>		initial_md_states;
+
+	// Atomistic states computed by this batch (only held by its root process)
+	MDStateCache						*md_state_cache;
+
+	// Node-local directory of the root process, where the initial restart files are
+	// copied on first use ("none" to read them from the output directory every time)
+	std::string							md_local_directory;
+
+	// Stress samples of the MD runs of this batch (only written by its root process)
+	MDSampleLog							md_sample_log;
+
 	ConditionalOStream 					mdcout;
 
 };
 
 
 template <int dim>
-STMDProblem<dim>::STMDProblem (MPI_Comm mdcomm, int pcolor)
+STMDProblem<dim>::STMDProblem (MPI_Comm mdcomm, int pcolor, MDStateCache *mdcache, std::string mdlocaldir)
 :
 md_batch_communicator (mdcomm),
 md_batch_n_processes (Utilities::MPI::n_mpi_processes(md_batch_communicator)),
 this_md_batch_process (Utilities::MPI::this_mpi_process(md_batch_communicator)),
 md_batch_pcolor (pcolor),
+md_state_cache (mdcache),
+md_local_directory (mdlocaldir),
 mdcout (std::cout,(this_md_batch_process == 0))
 {}
 
 
 template <int dim>
 STMDProblem<dim>::~STMDProblem ()
-{}
+{
+	// close down LAMMPS
+	if (lmp != NULL) delete lmp;
+}
+
+
+
+// Switch the log file and redefine the variables of the MD job (variables survive
+// a 'clear' in LAMMPS, they are therefore set for every job)
+template <int dim>
+void STMDProblem<dim>::set_job_variables (MDSim<dim> md_sim, bool store_log)
+{
+	char cline[1024];
+
+	if(store_log) sprintf(cline, "log %s/log.stress_strain", md_sim.log_file.c_str());
+	else sprintf(cline, "log none");
+	lammps_command(lmp,cline);
+
+	// Passing location for output as variable
+	sprintf(cline, "variable mdt string %s", md_sim.matid.c_str()); lammps_command(lmp,cline);
+	if(store_log) {sprintf(cline, "variable loco string %s", md_sim.log_file.c_str()); lammps_command(lmp,cline);}
+	sprintf(cline, "variable locs string %s", md_sim.scripts_folder.c_str()); lammps_command(lmp,cline);
+
+	// Setting testing temperature
+	sprintf(cline, "variable tempt equal %f", md_sim.temperature); lammps_command(lmp,cline);
+}
+
+
+
+// Wipe the engine and load the topology of the sample from a restart file, then
+// define its force field. When the initial restart file is loaded, it is read from
+// the node-local copy of the batch root if any (the copy is written on first use),
+// and the initial state of the topology is kept to restart the next MD jobs from
+// without reading it.
+template <int dim>
+void STMDProblem<dim>::load_topology (MDSim<dim> md_sim, const char *restartfile, bool initial_topology)
+{
+	char cline[1024];
+	char cfile[1024];
+
+	sprintf(cline, "clear"); lammps_command(lmp,cline);
+
+	// Setting general parameters for LAMMPS independentely of what will be
+	// tested on the sample next.
+	sprintf(cfile, "%s/%s", md_sim.scripts_folder.c_str(), "in.set.lammps");
+	lammps_file(lmp,cfile);
+
+	// Only the root process (process 0 of LAMMPS) reads and writes restart files
+	char localrestartfile[1024];
+	sprintf(localrestartfile, "%s/init.%s_%d.bin", md_local_directory.c_str(),
+			md_sim.matid.c_str(), md_sim.replica);
+	int local_copy = 0;
+	if (initial_topology && md_local_directory != "none" && this_md_batch_process == 0)
+		local_copy = file_exists(localrestartfile) ? 1 : 2;
+	MPI_Bcast(&local_copy, 1, MPI_INT, 0, md_batch_communicator);
+
+	if (local_copy == 1){
+		sprintf(cline, "read_restart %s", localrestartfile); lammps_command(lmp,cline);
+	}
+	else {
+		sprintf(cline, "read_restart %s", restartfile); lammps_command(lmp,cline);
+		if (local_copy == 2){
+			sprintf(cline, "write_restart %s", localrestartfile); lammps_command(lmp,cline);
+		}
+	}
+
+	// Force field, kept along with the topology for all the following jobs
+	sprintf(cfile, "%s/%s", md_sim.scripts_folder.c_str(), "in.potential.lammps");
+	lammps_file(lmp,cfile);
+
+	loaded_matid = md_sim.matid;
+	loaded_replica = md_sim.replica;
+	loaded_force_field = md_sim.force_field;
+
+	if (initial_topology){
+		MDState md_state;
+		gather_md_state(md_state);
+		if (this_md_batch_process == 0){
+			char mdstate[1024];
+			sprintf(mdstate, "%s_%d", md_sim.matid.c_str(), md_sim.replica);
+			initial_md_states[mdstate] = md_state;
+		}
+	}
+}
+
+
+// Retrieve positions, velocities and image flags of all the atoms, along with
+// the box geometry, from the LAMMPS engine (on every process of the batch)
+template <int dim>
+void STMDProblem<dim>::gather_md_state (MDState& md_state)
+{
+	int natoms = static_cast<int>(lammps_get_natoms(lmp));
+
+	md_state.x.resize(3*natoms);
+	md_state.v.resize(3*natoms);
+	md_state.image.resize(natoms);
+
+	lammps_gather_atoms(lmp, (char *) "x", 1, 3, &md_state.x[0]);
+	lammps_gather_atoms(lmp, (char *) "v", 1, 3, &md_state.v[0]);
+	lammps_gather_atoms(lmp, (char *) "image", 0, 1, &md_state.image[0]);
+
+	double *boxlo = (double *) lammps_extract_global(lmp, (char *) "boxlo");
+	double *boxhi = (double *) lammps_extract_global(lmp, (char *) "boxhi");
+	for(unsigned int k=0;k<3;k++){
+		md_state.boxlo[k] = boxlo[k];
+		md_state.boxhi[k] = boxhi[k];
+	}
+	md_state.tilt[0] = *((double *) lammps_extract_global(lmp, (char *) "xy"));
+	md_state.tilt[1] = *((double *) lammps_extract_global(lmp, (char *) "xz"));
+	md_state.tilt[2] = *((double *) lammps_extract_global(lmp, (char *) "yz"));
+}
+
+
+
+// Overwrite the box geometry and the atoms positions, velocities and image flags
+// of the topology held by the engine
+template <int dim>
+void STMDProblem<dim>::scatter_md_state (MDState& md_state)
+{
+	char cline[1024];
+
+	int natoms = static_cast<int>(lammps_get_natoms(lmp));
+	if (natoms != md_state.natoms()){
+		std::cerr << "Error: The cached MD state holds " << md_state.natoms()
+				<< " atoms while the initial state holds " << natoms << " atoms" << std::endl;
+		exit(1);
+	}
+
+	// lammps_scatter_atoms silently leaves the atoms unchanged without an atom map
+	// or atom IDs (it does not return any error), which would restart the MD job
+	// from the wrong atoms
+	if (lmp->atom->map_style == 0 || lmp->atom->tag_enable == 0){
+		std::cerr << "Error: Cannot restore the cached MD state without an atom map and atom IDs "
+				<< "('atom_modify map array' must be set before reading the restart file)" << std::endl;
+		exit(1);
+	}
+
+	sprintf(cline, "change_box all x final %.16e %.16e y final %.16e %.16e z final %.16e %.16e "
+			"xy final %.16e xz final %.16e yz final %.16e units box",
+			md_state.boxlo[0], md_state.boxhi[0], md_state.boxlo[1], md_state.boxhi[1],
+			md_state.boxlo[2], md_state.boxhi[2], md_state.tilt[0], md_state.tilt[1], md_state.tilt[2]);
+	lammps_command(lmp,cline);
+
+	lammps_scatter_atoms(lmp, (char *) "x", 1, 3, &md_state.x[0]);
+	lammps_scatter_atoms(lmp, (char *) "v", 1, 3, &md_state.v[0]);
+	lammps_scatter_atoms(lmp, (char *) "image", 0, 1, &md_state.image[0]);
+}
+
+
+
+// Broadcast of a state found by the root process to the whole batch
+template <int dim>
+bool STMDProblem<dim>::broadcast_md_state (bool found, MDState& md_state)
+{
+	int found_flag = found ? 1 : 0;
+	MPI_Bcast(&found_flag, 1, MPI_INT, 0, md_batch_communicator);
+	if (found_flag == 0) return false;
+
+	int natoms = md_state.natoms();
+	MPI_Bcast(&natoms, 1, MPI_INT, 0, md_batch_communicator);
+	if (this_md_batch_process != 0){
+		md_state.x.resize(3*natoms);
+		md_state.v.resize(3*natoms);
+		md_state.image.resize(natoms);
+	}
+	MPI_Bcast(md_state.boxlo, 3, MPI_DOUBLE, 0, md_batch_communicator);
+	MPI_Bcast(md_state.boxhi, 3, MPI_DOUBLE, 0, md_batch_communicator);
+	MPI_Bcast(md_state.tilt, 3, MPI_DOUBLE, 0, md_batch_communicator);
+	MPI_Bcast(&md_state.x[0], 3*natoms, MPI_DOUBLE, 0, md_batch_communicator);
+	MPI_Bcast(&md_state.v[0], 3*natoms, MPI_DOUBLE, 0, md_batch_communicator);
+	MPI_Bcast(&md_state.image[0], natoms, MPI_INT, 0, md_batch_communicator);
+
+	return true;
+}
+
+
+
+// Look for the state to restart from in the cache of the batch (the states held by the
+// previous batch layout having been moved to the roots of the new batches)
+template <int dim>
+bool STMDProblem<dim>::load_md_state (MDSim<dim> md_sim, int load_qp_id, MDState& md_state)
+{
+	bool found = false;
+	if (this_md_batch_process == 0)
+		found = md_state_cache->load(load_qp_id, md_sim.material, md_sim.replica, md_state);
+	return broadcast_md_state(found, md_state);
+}
+
+
+
+// Look for the initial state of the topology of the job, if it has been loaded by this engine
+template <int dim>
+bool STMDProblem<dim>::load_initial_md_state (MDSim<dim> md_sim, MDState& md_state)
+{
+	bool found = false;
+	if (this_md_batch_process == 0){
+		char mdstate[1024];
+		sprintf(mdstate, "%s_%d", md_sim.matid.c_str(), md_sim.replica);
+		std::map<std::string, MDState>::const_iterator it = initial_md_states.find(mdstate);
+		if (it != initial_md_states.end()){
+			md_state = it->second;
+			found = true;
+		}
+	}
+	return broadcast_md_state(found, md_state);
+}
 
 
 // The straining function is ran on every quadrature point which
@@ -108,65 +347,48 @@ SymmetricTensor<2,dim> STMDProblem<dim>::lammps_straining (MDSim<dim> md_sim)
 	sprintf(straindata_lcts, "%s/lcts.%d.%s.dump", md_sim.restart_folder.c_str(),
 			md_sim.qp_id, mdstate);
 
-	// Find relevant dump file,
-	// Check if this qp made a dump file of or it is branching from a previous qp
+	// Find relevant state to restart from,
+	// Check if this qp has computed a state already or it is branching from a previous qp
+	// (if 'most_recent_qp_id' is still set as its default value, no state is to be found
+	// and the MD simulation is performed using the initial position of the atoms)
+	int load_qp_id = md_sim.qp_id;
+	if (md_sim.qp_id != md_sim.most_recent_qp_id) load_qp_id = md_sim.most_recent_qp_id;
+
+	// State copied from the restart files (lcts) of a previous run
 	char straindata_last_load[1024];
-	char straindata_last_write[1024];
-	if (md_sim.qp_id != md_sim.most_recent_qp_id){
-		sprintf(straindata_last_load, "%s/last.%d.%s.dump", md_sim.output_folder.c_str(),
-				md_sim.most_recent_qp_id, mdstate);
-		sprintf(straindata_last_write, "%s/last.%d.%s.dump", md_sim.output_folder.c_str(),
-						md_sim.qp_id, mdstate);
-		// Check if the 'most_recent_qp_id' is still set as its default value,
-		// if it is then there should not be any dumpfile to be found which will cause
-		// the MD simulation should be performed using the initial position of the atoms,
-		// else the dump file should exist
-		std::ifstream ifile_most_recent(straindata_last_load);
-		if(md_sim.most_recent_qp_id==std::numeric_limits<uint32_t>::max()){
-			assert (ifile_most_recent.good() == false);
-		}
-		else{
-			assert (ifile_most_recent.good() == true);
-			ifile_most_recent.close();
-		}
-	}
-	else {
-		sprintf(straindata_last_load, "%s/last.%d.%s.dump", md_sim.output_folder.c_str(),
-				md_sim.qp_id, mdstate);
-		sprintf(straindata_last_write, "%s", straindata_last_load);
-	}
+	sprintf(straindata_last_load, "%s/last.%d.%s.dump", md_sim.output_folder.c_str(),
+			load_qp_id, mdstate);
 
 	char cline[1024];
 	char cfile[1024];
 
-	// Specifying the command line options for screen and log output file
-	int nargs = 5;
-	char **lmparg = new char*[nargs];
-	lmparg[0] = NULL;
-	lmparg[1] = (char *) "-screen";
-	lmparg[2] = (char *) "none";
-	lmparg[3] = (char *) "-log";
-	lmparg[4] = new char[1024];
-	if(store_log) sprintf(lmparg[4], "%s/log.stress_strain", md_sim.log_file.c_str());
-	else sprintf(lmparg[4], "none");
-
-	// Creating LAMMPS instance
-	LAMMPS *lmp = NULL;
-	lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
-
-	// Passing location for output as variable
-	sprintf(cline, "variable mdt string %s", md_sim.matid.c_str()); lammps_command(lmp,cline);
-	if(store_log) {sprintf(cline, "variable loco string %s", md_sim.log_file.c_str()); lammps_command(lmp,cline);}
-	sprintf(cline, "variable locs string %s", md_sim.scripts_folder.c_str()); lammps_command(lmp,cline);
-
-	// Setting testing temperature
-	sprintf(cline, "variable tempt equal %f", md_sim.temperature); lammps_command(lmp,cline);
-
-	// Setting general parameters for LAMMPS independentely of what will be
-	// tested on the sample next.
+	// Creating the LAMMPS engine of the batch on the first job
+	if (lmp == NULL){
+		// Specifying the command line options for screen and log output file,
+		// the log file is then switched per job with the 'log' command
+		int nargs = 5;
+		char **lmparg = new char*[nargs];
+		lmparg[0] = NULL;
+		lmparg[1] = (char *) "-screen";
+		lmparg[2] = (char *) "none";
+		lmparg[3] = (char *) "-log";
+		lmparg[4] = (char *) "none";
+
+		// Creating LAMMPS instance
+		lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
+
+		delete[] lmparg;
+
+		// The force field is always defined along with the topology, the homogenization
+		// following the straining therefore does not redefine it
+		sprintf(cline, "variable skip_potential string 1"); lammps_command(lmp,cline);
+	}
 
-	sprintf(cfile, "%s/%s", md_sim.scripts_folder.c_str(), "in.set.lammps");
-	lammps_file(lmp,cfile);
+	// Recycling the LAMMPS engine of the batch, the topology it holds is kept if the
+	// job runs on the same material, replica and force field
+	set_job_variables(md_sim, store_log);
+	bool same_topology = (loaded_matid == md_sim.matid && loaded_replica == md_sim.replica
+			&& loaded_force_field == md_sim.force_field);
 
 	/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
@@ -179,29 +401,35 @@ SymmetricTensor<2,dim> STMDProblem<dim>::lammps_straining (MDSim<dim> md_sim)
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "   ... from previous state data...   " << std::flush;*/
 
-	// Check the presence of a dump file to restart from
-	// (either from current or previous ID_to_get_results_from)
+	// Check the presence of a state to restart from, in memory first, then
+	// of a dump file (either from current or previous ID_to_get_results_from)
+	MDState md_state;
 	std::ifstream ifile(straindata_last_load);
-	if (ifile.good()){
+	if (load_md_state(md_sim, load_qp_id, md_state)){
+		if (!same_topology) load_topology(md_sim, initdata, true);
+		scatter_md_state(md_state);
+
+		sprintf(cline, "print 'specifically computed'"); lammps_command(lmp,cline);
+	}
+	else if (ifile.good()){
 		/*mdcout << "  specifically computed." << std::endl;*/
 		ifile.close();
 
 		if (md_sim.force_field == "reax") {
-			sprintf(cline, "read_restart %s", initdata); lammps_command(lmp,cline); /*reaxff*/
+			if (!same_topology) load_topology(md_sim, initdata, true); /*reaxff*/
 			sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_last_load); /*reaxff*/
 			lammps_command(lmp,cline); /*reaxff*/
 		}
 		else if (md_sim.force_field == "opls") {
-			sprintf(cline, "read_restart %s", straindata_last_load); /*opls*/
-			lammps_command(lmp,cline); /*opls*/
+			load_topology(md_sim, straindata_last_load, false); /*opls*/
 		}
 
 		sprintf(cline, "print 'specifically computed'"); lammps_command(lmp,cline);
 	}
 	else{
 		/*mdcout << "  initially computed." << std::endl;*/
-		sprintf(cline, "read_restart %s", initdata);
-		lammps_command(lmp,cline);
+		if (same_topology && load_initial_md_state(md_sim, md_state)) scatter_md_state(md_state);
+		else load_topology(md_sim, initdata, true);
 		sprintf(cline, "print 'initially computed'"); lammps_command(lmp,cline);
 	}
 
@@ -252,15 +480,10 @@ SymmetricTensor<2,dim> STMDProblem<dim>::lammps_straining (MDSim<dim> md_sim)
 	/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "Saving state data...       " << std::endl;*/
-	// Save data to specific file for this quadrature point
-	if (md_sim.force_field == "opls"){
-		sprintf(cline, "write_restart %s", straindata_last_write); /*opls*/
-		lammps_command(lmp,cline); /*opls*/
-	}
-	else if (md_sim.force_field == "reax"){
-		sprintf(cline, "write_dump all custom %s id type xs ys zs vx vy vz ix iy iz", straindata_last_write); /*reaxff*/
-		lammps_command(lmp,cline); /*reaxff*/
-	}
+	// Save state for this quadrature point in the cache of the batch
+	gather_md_state(md_state);
+	if (this_md_batch_process == 0)
+		md_state_cache->store(md_sim.qp_id, md_sim.material, md_sim.replica, md_state);
 
 	if(md_sim.checkpoint){
 		if (md_sim.force_field == "opls") {
@@ -270,40 +493,17 @@ SymmetricTensor<2,dim> STMDProblem<dim>::lammps_straining (MDSim<dim> md_sim)
 			sprintf(cline, "write_dump all custom %s id type xs ys zs vx vy vz ix iy iz", straindata_lcts); lammps_command(lmp,cline); /*reaxff*/
 		}
 	}
-	// close down LAMMPS
-	delete lmp;
 
 	/*mdcout << "               "
 				<< "(MD - " << timeid <<"."<< cellid << " - repl " << repl << ") "
 				<< "Homogenization of stiffness and stress using in.elastic.lammps...       " << std::endl;*/
 
-	// Creating LAMMPS instance
-	if(store_log) sprintf(lmparg[4], "%s/log.homogenization", md_sim.log_file.c_str());
-	else sprintf(lmparg[4], "none");
-	lmp = new LAMMPS(nargs,lmparg,md_batch_communicator);
-
-	if(store_log) {sprintf(cline, "variable loco string %s", md_sim.log_file.c_str()); lammps_command(lmp,cline);}
-	sprintf(cline, "variable locs string %s", md_sim.scripts_folder.c_str()); lammps_command(lmp,cline);
-
-	// Setting testing temperature
-	sprintf(cline, "variable tempt equal %f", md_sim.temperature); lammps_command(lmp,cline);
-
-	// Setting general parameters for LAMMPS independentely of what will be
-	// tested on the sample next.
-	sprintf(cfile, "%s/%s", md_sim.scripts_folder.c_str(), "in.set.lammps");
-	lammps_file(lmp,cfile);
-
-	if (md_sim.force_field == "reax"){
-		sprintf(cline, "read_restart %s", initdata); /*reaxff*/
-		lammps_command(lmp,cline); /*reaxff*/
-		sprintf(cline, "rerun %s dump x y z vx vy vz ix iy iz box yes scaled yes wrapped yes format native", straindata_last_write); /*reaxff*/
-		lammps_command(lmp,cline); /*reaxff*/
-
-	}
-	else if (md_sim.force_field == "opls"){
-		sprintf(cline, "read_restart %s", straindata_last_write); /*opls*/
-		lammps_command(lmp,cline); /*opls*/
-	}
+	// The strained state is still held by the LAMMPS engine, so the homogenization
+	// is run straight after the straining, without reloading the settings, the force
+	// field and the state that has just been written
+	if(store_log) sprintf(cline, "log %s/log.homogenization", md_sim.log_file.c_str());
+	else sprintf(cline, "log none");
+	lammps_command(lmp,cline);
 
 	sprintf(cline, "reset_timestep 0"); lammps_command(lmp,cline);
 
@@ -356,56 +556,46 @@ SymmetricTensor<2,dim> STMDProblem<dim>::lammps_straining (MDSim<dim> md_sim)
 		}
 		stress_dist.push_back(stress_sample);
 	}
+	sprintf(cline, "unfix stress_series"); lammps_command(lmp,cline);
 
-	// (stress distribution) Append molecular model data file
+	// (stress distribution) Append molecular model data to the sample log of the batch
 	if(this_md_batch_process == 0){
 
-		// Initialization of the molecular data file
-		char filename[1024]; sprintf(filename, "%s/mddata_qpid%d_repl%d.csv", md_sim.output_folder.c_str(), md_sim.qp_id, md_sim.replica);
-		std::ofstream  ofile(filename, std::ios_base::app);
-		long cursor_position = ofile.tellp();
-
-		// writing the header of the file (if file is empty)
-		if (cursor_position == 0){
-			ofile << "qp_id,material_id,time_id,temperature,strain_rate,force_field,replica_id";
+		char filename[1024]; sprintf(filename, "%s/mddata.batch%d.bin", md_sim.output_folder.c_str(), md_batch_pcolor);
+		md_sample_log.open(filename);
+
+		MDSampleRecordHeader header;
+		memset(&header, 0, sizeof(MDSampleRecordHeader));
+		header.qp_id = md_sim.qp_id;
+		header.replica = md_sim.replica;
+		header.n_samples = md_sim.nsteps_sample;
+		header.n_components = SymmetricTensor<2,dim>::n_independent_components;
+		strncpy(header.matid, md_sim.matid.c_str(), sizeof(header.matid)-1);
+		strncpy(header.time_id, md_sim.time_id.c_str(), sizeof(header.time_id)-1);
+		strncpy(header.force_field, md_sim.force_field.c_str(), sizeof(header.force_field)-1);
+		header.temperature = md_sim.temperature;
+		header.strain_rate = md_sim.strain_rate;
+
+		// components ordered as 00, 01, 02, 11, 12, 22
+		std::vector<double> strain, samples;
+		for(unsigned int k=0;k<dim;k++)
+			for(unsigned int l=k;l<dim;l++)
+				strain.push_back(md_sim.strain[k][l]);
+		for(unsigned int t=0;t<md_sim.nsteps_sample;t++)
 			for(unsigned int k=0;k<dim;k++)
 				for(unsigned int l=k;l<dim;l++)
-					ofile << "," << "strain_" << k << l;
-			for(unsigned int k=0;k<dim;k++)
-				for(unsigned int l=k;l<dim;l++)
-					ofile << "," << "stress_" << k << l;
-			ofile << std::endl;
-		}
-
-		// writing current time data
-		for(unsigned int t=0;t<md_sim.nsteps_sample;t++){
-		   ofile << md_sim.qp_id
-				 << "," << md_sim.matid
-				 << "," << md_sim.time_id
-				 << "," << md_sim.temperature
-				 << "," << md_sim.strain_rate
-				 << "," << md_sim.force_field
-				 << "," << md_sim.replica;
-		   for(unsigned int k=0;k<dim;k++)
-			  for(unsigned int l=k;l<dim;l++){
-				  ofile << "," << std::setprecision(16) << md_sim.strain[k][l];
-			  }
-		   for(unsigned int k=0;k<dim;k++)
-			  for(unsigned int l=k;l<dim;l++){
-				  ofile << "," << std::setprecision(16) << stress_dist[t][k][l];
-			  }
-		   ofile << std::endl;
-		}
+					samples.push_back(stress_dist[t][k][l]);
 
+		md_sample_log.append(header, strain, samples);
 	}
 
-	if(md_sim.output_homog){
+	if(md_sim.output_homog && store_log){
 		// Unetting dumping of atom positions
 		sprintf(cline, "undump atom_dump"); lammps_command(lmp,cline);
 	}
 
-	// close down LAMMPS
-	delete lmp;
+	// Release the log file before the log directory is cleaned
+	sprintf(cline, "log none"); lammps_command(lmp,cline);
 
 	if(store_log) {
 		// Clean "nanoscale_logs" of the finished timestep
@@ -20,6 +20,7 @@
 
 // Specifically built header files
 #include "md_sim.h"
+#include "md_state_cache.h"
 #include "read_write.h"
 #include "math_calc.h"
 #include "stmd_problem.h"
@@ -54,6 +55,39 @@ struct ReplicaData
 	SymmetricTensor<4,dim> init_stiff;
 };
 
+// Strong-scaling model of the MD simulation of a replica, fitted on the measured
+// wall-times per MD timestep as t(p) = a + b/p (Amdahl's law)
+struct MDScalingModel
+{
+	double sx = 0., sy = 0., sxx = 0., sxy = 0.;
+	int n = 0;
+
+	void add_measure (unsigned int nprocs, double time_per_step)
+	{
+		double x = 1./nprocs;
+		sx += x; sy += time_per_step;
+		sxx += x*x; sxy += x*time_per_step;
+		n++;
+	}
+
+	bool measured () const
+	{
+		return n > 0;
+	}
+
+	double time_per_step (unsigned int nprocs) const
+	{
+		double x = 1./nprocs;
+		double det = n*sxx - sx*sx;
+		// Measures at a single core count or non-physical fit, assuming perfect scaling
+		if (det <= 1.0e-12*n*sxx) return x*sxy/sxx;
+		double b = (n*sxy - sx*sy)/det;
+		double a = (sy - b*sx)/n;
+		if (a < 0. || b < 0.) return x*sxy/sxx;
+		return a + b*x;
+	}
+};
+
 template <int dim>
 class STMDSync
 {
@@ -66,28 +100,40 @@ public:
 			int fchpt, int fohom, unsigned int mppn,
 			std::vector<std::string> mdt, Tensor<1,dim> cgd, unsigned int nr, bool ups,
 			boost::property_tree::ptree inconfig, bool approx_md_with_hookes_law);
-	void update (int tstp, double ime, int nstp, ScaleBridgingData& scale_bridging_data);
+	void plan (int tstp, double ptime, int nstp, ScaleBridgingData& scale_bridging_data);
+	void update (ScaleBridgingData& scale_bridging_data);
 
 private:
 	void restart ();
 
-	void set_md_procs (int nmdruns);
+	void set_md_procs (std::vector<MDSim<dim> >& md_simulations);
+	bool plan_md_batches (std::vector<MDSim<dim> >& md_simulations,
+			std::vector<unsigned int>& admissible_sizes, unsigned int npnode, double& makespan);
+	double assign_md_runs (std::vector<MDSim<dim> >& md_simulations,
+			std::vector<unsigned int>& batch_sizes, std::vector<int>& batch_of_run);
+	bool pack_md_batches (std::vector<unsigned int>& run_sizes, unsigned int npnode,
+			std::vector<int>& pcolors, std::vector<int>& batch_of_run, std::vector<unsigned int>& batch_sizes);
+	void migrate_md_states ();
 
 	void load_replica_generation_data();
 	void load_replica_equilibration_data();
 
 	void average_replica_data();
 
-	std::vector<MDSim<dim> > prepare_md_simulations(ScaleBridgingData scale_bridging_data);
+	std::vector<MDSim<dim> > prepare_md_simulations(const ScaleBridgingData& scale_bridging_data);
 
+	double estimate_md_nsteps(MDSim<dim>& md_sim, double strain_norm);
+	double predict_md_time_per_step(MDSim<dim>& md_sim, unsigned int nprocs);
+	void dispatch_md_simulations(std::vector<MDSim<dim> >& md_simulations);
+	void set_md_strains(std::vector<MDSim<dim> >& md_simulations, ScaleBridgingData& scale_bridging_data);
+	void update_md_cost_model(std::vector<MDSim<dim> >& md_simulations);
 	void execute_inside_md_simulations(std::vector<MDSim<dim> >& requested_simulations);
-	void share_stresses(std::vector<MDSim<dim> >& md_simulations);
 
 	void write_exec_script_md_job();
 	void generate_job_list(bool& elmj, int& tta, char* filenamelist);
 	void execute_pjm_md_simulations();
 
-	void store_md_simulations(std::vector<MDSim<dim> > md_simulations,
+	void store_md_simulations(const std::vector<MDSim<dim> >& md_simulations,
 			ScaleBridgingData& scale_bridging_data);
 
 	MPI_Comm 							mmd_communicator;
@@ -100,6 +146,41 @@ private:
 	int32_t 								mmd_pcolor;
 	int32_t									md_batch_pcolor;
 
+	// MD engine of the batch this process belongs to, kept over successive
+	// updates as long as the batch layout remains the same
+	STMDProblem<dim>						*stmd_problem = NULL;
+
+	// Layout of the batches: number of processes of each batch, batch of each
+	// process, root process of each batch, and batch each MD run has been sized
+	// for (heterogeneous layout only)
+	bool									heterogeneous_md_batches;
+	bool									md_heterogeneous_layout = false;
+	double									md_batch_layout_tolerance;
+	std::vector<unsigned int>				md_batch_sizes;
+	std::vector<int>						md_batch_pcolors;
+	std::vector<int>						md_batch_roots;
+	std::vector<int>						md_planned_batch_of_run;
+
+	// MD runs of the current update, planned from the description of the updates,
+	// their strains being only known by the batch running them
+	std::vector<MDSim<dim> >				md_runs;
+
+	// Atomistic states computed by the batch, to restart the next MD runs from,
+	// and batch each MD run of the current update is executed by
+	MDStateCache							md_state_cache;
+	std::string								md_state_cache_directory;
+	std::vector<int>						md_batch_of_run;
+
+	// Queue of the MD runs of the current update executed by this batch (longest
+	// expected first)
+	std::vector<int>						md_local_queue;
+
+	// Cost model of the MD runs: expected number of MD timesteps of each run of the
+	// current update, and strong-scaling model of each replica
+	std::vector<double>						md_nsteps_of_run;
+	std::vector<double>						md_walltime_of_run;
+	std::vector<MDScalingModel>				md_scaling_models;
+
 	uint32_t						ncupd;
 
 	uint32_t						machine_ppn;
@@ -161,7 +242,9 @@ template <int dim>
 STMDSync<dim>::STMDSync (MPI_Comm mcomm, int pcolor)
 :
 mmd_communicator (mcomm),
+md_batch_communicator (MPI_COMM_NULL),
 mmd_n_processes (Utilities::MPI::n_mpi_processes(mmd_communicator)),
+md_batch_n_processes (0),
 this_mmd_process (Utilities::MPI::this_mpi_process(mmd_communicator)),
 mmd_pcolor (pcolor),
 mcout (std::cout,(this_mmd_process == 0))
@@ -171,7 +254,21 @@ mcout (std::cout,(this_mmd_process == 0))
 
 template <int dim>
 STMDSync<dim>::~STMDSync ()
-{}
+{
+	if (stmd_problem != NULL) delete stmd_problem;
+	if (md_batch_communicator != MPI_COMM_NULL) MPI_Comm_free(&md_batch_communicator);
+
+	// Cleaning the node-local directory of the states and restart files held by this process
+	if (!md_state_cache_directory.empty() && md_state_cache_directory != "none"){
+		md_state_cache.clear();
+		char command[1024];
+		sprintf(command, "rm -rf %s/md_state_cache.%d", md_state_cache_directory.c_str(), this_mmd_process);
+		int ret = system(command);
+		if (ret!=0){
+			std::cerr << "Failed to remove the node-local directory of the MD states!" << std::endl;
+		}
+	}
+}
 
 
 
@@ -200,10 +297,11 @@ void STMDSync<dim>::restart ()
 
 
 template <int dim>
-void STMDSync<dim>::set_md_procs (int nmdruns)
+void STMDSync<dim>::set_md_procs (std::vector<MDSim<dim> >& md_simulations)
 {
 	// Dispatch of the available processes on to different groups for parallel
 	// update of quadrature points
+	uint32_t nmdruns = md_simulations.size();
 
 	// Setting the minimum possible allocation per MD sim
 	unsigned int npbtch_min = input_config.get<unsigned int>("computational resources.minimum number of cores for MD simulation");
@@ -211,6 +309,10 @@ void STMDSync<dim>::set_md_procs (int nmdruns)
 	// Setting the number of cores per node
 	unsigned int npnode = input_config.get<unsigned int>("computational resources.machine cores per node");
 
+	// Keeping track of the previous batch layout to recycle the batch communicators
+	// and their MD engines if it does not change
+	std::vector<int> previous_md_batch_pcolors = md_batch_pcolors;
+
 	unsigned int fair_npbtch;
 	if (nmdruns > 0){
 		fair_npbtch = int(mmd_n_processes/(nmdruns));
@@ -234,46 +336,353 @@ void STMDSync<dim>::set_md_procs (int nmdruns)
 
 	}
 
+	if (list_possible_cores_per_job.size() == 0){
+		std::cout << "Error: No admissible number of cores per MD simulation batch!" << std::endl;
+		exit(1);
+	}
+
 	// Setting core allocation as the largest admissible core count inferior to the fair core count
+	// (or the smallest admissible one if there are more MD runs than batches)
+	unsigned int uniform_npbtch = list_possible_cores_per_job[0];
 	for(unsigned int ic=0; ic<list_possible_cores_per_job.size(); ic++){
 		if (list_possible_cores_per_job[ic] > fair_npbtch) break;
-		// Setting the number of processes per md simulation "md_batch_n_processes"
-		md_batch_n_processes = list_possible_cores_per_job[ic];
+		uniform_npbtch = list_possible_cores_per_job[ic];
+	}
+
+	// Hysteresis on the size of the uniform batches: the size of the previous uniform
+	// layout is kept as long as it is within a factor 2 of the new one, so that the batches
+	// and their MD engines survive the variations of the number of MD runs between updates
+	if (!md_heterogeneous_layout && md_batch_sizes.size() > 0){
+		unsigned int previous_npbtch = md_batch_sizes[0];
+		if (previous_npbtch <= 2*uniform_npbtch && uniform_npbtch <= 2*previous_npbtch)
+			uniform_npbtch = previous_npbtch;
 	}
 
-	// Throw error if md_batch_n_processes is not set in the range
+	// Throw error if uniform_npbtch is not set in the range
 	// from minimum possible allocation (npbtch_min) to total core count (mmd_n_processes)
 	// and not set as either a factor or a multiple of the number of cores per node (npnode)
-	if (md_batch_n_processes < npbtch_min || md_batch_n_processes > mmd_n_processes
-			|| (npnode%md_batch_n_processes!=0 and md_batch_n_processes%npnode!=0)){
+	if (uniform_npbtch < npbtch_min || uniform_npbtch > mmd_n_processes
+			|| (npnode%uniform_npbtch!=0 and uniform_npbtch%npnode!=0)){
 		std::cout << "Error: The number of cores per MD simulation batch (md_batch_n_processes) is not well set!" << std::endl;
 		exit(1);
 	}
 
-	n_md_batches = int(mmd_n_processes/md_batch_n_processes);
-	if(n_md_batches == 0) {n_md_batches=1; md_batch_n_processes=mmd_n_processes;}
+	// If every MD run can have its own batch, size each batch from the expected cost
+	// of its run, otherwise all the batches have the same size
+	md_planned_batch_of_run.clear();
+	bool heterogeneous_layout = false;
+	if (heterogeneous_md_batches && nmdruns*list_possible_cores_per_job[0] <= mmd_n_processes){
+		std::vector<unsigned int> previous_md_batch_sizes = md_batch_sizes;
+		double planned_makespan;
+		heterogeneous_layout = plan_md_batches(md_simulations, list_possible_cores_per_job, npnode, planned_makespan);
+
+		// Hysteresis on the heterogeneous layout: the previous batches are kept, with the
+		// runs assigned to them longest first, unless the new plan is expected to be
+		// significantly shorter
+		if (heterogeneous_layout && md_heterogeneous_layout){
+			std::vector<int> previous_batch_of_run;
+			double previous_makespan = assign_md_runs(md_simulations, previous_md_batch_sizes, previous_batch_of_run);
+			if (previous_makespan <= (1. + md_batch_layout_tolerance)*planned_makespan){
+				md_batch_sizes = previous_md_batch_sizes;
+				md_batch_pcolors = previous_md_batch_pcolors;
+				md_planned_batch_of_run = previous_batch_of_run;
+			}
+		}
+	}
+	md_heterogeneous_layout = heterogeneous_layout;
+
+	if (!heterogeneous_layout){
+		uint32_t n_uniform_batches = int(mmd_n_processes/uniform_npbtch);
+		if(n_uniform_batches == 0) {n_uniform_batches=1; uniform_npbtch=mmd_n_processes;}
+
+		md_batch_sizes.assign(n_uniform_batches, uniform_npbtch);
+
+		// LAMMPS processes color: regroup processes by batches of size NB, except
+		// the last ones (me >= NB*NC) to create batches of only NB processes, nor smaller.
+		// Initially we used MPI_UNDEFINED, but why waste processes... The processes over
+		// 'n_lammps_processes_per_batch*n_lammps_batch' are assigned to the last batch...
+		// finally it is better to waste them than failing the simulation with an odd number
+		// of processes for the last batch
+		md_batch_pcolors.assign(mmd_n_processes, MPI_UNDEFINED);
+		for (uint32_t p=0; p<uniform_npbtch*n_uniform_batches; p++)
+			md_batch_pcolors[p] = int(p/uniform_npbtch);
+	}
 
-	mcout << "        " << "...number of processes per batches: " << md_batch_n_processes
-			<< "   ...number of batches: " << n_md_batches << std::endl;
+	n_md_batches = md_batch_sizes.size();
+	md_batch_pcolor = md_batch_pcolors[this_mmd_process];
+	if (md_batch_pcolor == MPI_UNDEFINED) md_batch_n_processes = 0;
+	else md_batch_n_processes = md_batch_sizes[md_batch_pcolor];
+
+	// The root of a batch is its first process
+	md_batch_roots.assign(n_md_batches, -1);
+	for (int p=mmd_n_processes-1; p>=0; p--)
+		if (md_batch_pcolors[p] != MPI_UNDEFINED) md_batch_roots[md_batch_pcolors[p]] = p;
+
+	if (heterogeneous_layout){
+		mcout << "        " << "...number of processes per batches:";
+		for (uint32_t b=0; b<n_md_batches; b++) mcout << " " << md_batch_sizes[b];
+		mcout << "   ...number of batches: " << n_md_batches << std::endl;
+	}
+	else {
+		mcout << "        " << "...number of processes per batches: " << md_batch_sizes[0]
+				<< "   ...number of batches: " << n_md_batches << std::endl;
+	}
 
-	md_batch_pcolor = MPI_UNDEFINED;
+	// Same batches as for the previous update, LAMMPS engines are kept alive
+	if (md_batch_pcolors == previous_md_batch_pcolors) return;
 
-	// LAMMPS processes color: regroup processes by batches of size NB, except
-	// the last ones (me >= NB*NC) to create batches of only NB processes, nor smaller.
-	if(this_mmd_process < md_batch_n_processes*n_md_batches)
-		md_batch_pcolor = int(this_mmd_process/md_batch_n_processes);
-	// Initially we used MPI_UNDEFINED, but why waste processes... The processes over
-	// 'n_lammps_processes_per_batch*n_lammps_batch' are assigned to the last batch...
-	// finally it is better to waste them than failing the simulation with an odd number
-	// of processes for the last batch
-	/*else
-			mmd_pcolor = int((md_batch_n_processes*n_md_batches-1)/md_batch_n_processes);
-	 */
+	// Releasing the MD engine and the communicator of the previous batch layout
+	if (stmd_problem != NULL){
+		delete stmd_problem;
+		stmd_problem = NULL;
+	}
+	if (md_batch_communicator != MPI_COMM_NULL) MPI_Comm_free(&md_batch_communicator);
 
 	// Definition of the communicators
 	MPI_Comm_split(mmd_communicator, md_batch_pcolor, this_mmd_process, &md_batch_communicator);
-	MPI_Comm_rank(md_batch_communicator,&this_md_batch_process);
 
+	if (md_batch_communicator != MPI_COMM_NULL){
+		MPI_Comm_rank(md_batch_communicator,&this_md_batch_process);
+
+		// Node-local directory of the state cache and of the copies of the initial restart
+		// files, unique per batch root (the first process of the batch)
+		std::string batch_cache_directory = "none";
+		if (md_state_cache_directory != "none")
+			batch_cache_directory = md_state_cache_directory + "/md_state_cache."
+					+ std::to_string(md_batch_roots[md_batch_pcolor]);
+		if (this_md_batch_process == 0 && batch_cache_directory != "none"){
+			mkdir(batch_cache_directory.c_str(), ACCESSPERMS);
+			md_state_cache.set_spill_directory(batch_cache_directory);
+		}
+
+		// One long-lived MD engine per batch, keeping its topology in between MD jobs
+		stmd_problem = new STMDProblem<dim> (md_batch_communicator, md_batch_pcolor, &md_state_cache,
+				batch_cache_directory);
+	}
+
+	// The states held by processes that are no longer batch roots are moved to the root
+	// of their new batch, to be available to the next MD runs
+	migrate_md_states();
+}
+
+
+
+
+// Malleable allocation of the MD runs: each run gets its own batch, starting at the
+// smallest admissible size, then the batch of the run expected to finish last is
+// grown to the next admissible size, as long as it shortens that run and all the
+// batches can still be packed on the nodes. The expected time of the run finishing
+// last is returned as the makespan of the plan.
+template <int dim>
+bool STMDSync<dim>::plan_md_batches (std::vector<MDSim<dim> >& md_simulations,
+		std::vector<unsigned int>& admissible_sizes, unsigned int npnode, double& makespan)
+{
+	uint32_t n_md_runs = md_simulations.size();
+	const std::vector<double> &nsteps = md_nsteps_of_run;
+
+	std::vector<unsigned int> size_index (n_md_runs, 0);
+	std::vector<unsigned int> run_sizes (n_md_runs, admissible_sizes[0]);
+
+	std::vector<int> pcolors, batch_of_run;
+	std::vector<unsigned int> batch_sizes;
+	if (!pack_md_batches(run_sizes, npnode, pcolors, batch_of_run, batch_sizes)) return false;
+
+	while (true)
+	{
+		uint32_t longest = 0;
+		double longest_time = -1.;
+		for (uint32_t i=0; i<n_md_runs; ++i){
+			double expected_time = nsteps[i]*predict_md_time_per_step(md_simulations[i], run_sizes[i]);
+			if (expected_time > longest_time){
+				longest = i;
+				longest_time = expected_time;
+			}
+		}
+		makespan = longest_time;
+
+		if (size_index[longest]+1 >= admissible_sizes.size()) break;
+		unsigned int next_size = admissible_sizes[size_index[longest]+1];
+		if (nsteps[longest]*predict_md_time_per_step(md_simulations[longest], next_size) >= longest_time) break;
+
+		std::vector<unsigned int> grown_run_sizes = run_sizes;
+		grown_run_sizes[longest] = next_size;
+
+		std::vector<int> grown_pcolors, grown_batch_of_run;
+		std::vector<unsigned int> grown_batch_sizes;
+		if (!pack_md_batches(grown_run_sizes, npnode, grown_pcolors, grown_batch_of_run, grown_batch_sizes)) break;
+
+		run_sizes = grown_run_sizes;
+		size_index[longest]++;
+		pcolors = grown_pcolors;
+		batch_of_run = grown_batch_of_run;
+		batch_sizes = grown_batch_sizes;
+	}
+
+	md_batch_sizes = batch_sizes;
+	md_batch_pcolors = pcolors;
+	md_planned_batch_of_run = batch_of_run;
+
+	return true;
+}
+
+
+
+
+// First-fit decreasing packing of the batches on the nodes, assuming processes are
+// placed on the nodes by blocks of npnode consecutive ranks: batches spanning whole
+// nodes take the first set of consecutive empty nodes, the others the first node
+// with enough free cores. Batches are numbered by decreasing size, so that the
+// first process always belongs to the first batch.
+template <int dim>
+bool STMDSync<dim>::pack_md_batches (std::vector<unsigned int>& run_sizes, unsigned int npnode,
+		std::vector<int>& pcolors, std::vector<int>& batch_of_run, std::vector<unsigned int>& batch_sizes)
+{
+	uint32_t n_md_runs = run_sizes.size();
+
+	unsigned int n_nodes = (mmd_n_processes + npnode - 1)/npnode;
+	std::vector<unsigned int> node_capacity (n_nodes);
+	for (unsigned int k=0; k<n_nodes; k++)
+		node_capacity[k] = std::min(npnode, mmd_n_processes - k*npnode);
+	std::vector<unsigned int> node_free = node_capacity;
+
+	std::vector<uint32_t> order (n_md_runs);
+	for (uint32_t i=0; i<n_md_runs; ++i) order[i] = i;
+	std::stable_sort(order.begin(), order.end(),
+			[&run_sizes](uint32_t a, uint32_t b){ return run_sizes[a] > run_sizes[b]; });
+
+	pcolors.assign(mmd_n_processes, MPI_UNDEFINED);
+	batch_of_run.assign(n_md_runs, -1);
+	batch_sizes.clear();
+	for (uint32_t c=0; c<n_md_runs; ++c)
+	{
+		uint32_t i = order[c];
+		unsigned int first_process = 0;
+		bool placed = false;
+
+		if (run_sizes[i] >= npnode){
+			unsigned int n_span = run_sizes[i]/npnode;
+			for (unsigned int k=0; k+n_span<=n_nodes && !placed; k++){
+				bool empty_nodes = true;
+				for (unsigned int l=k; l<k+n_span; l++)
+					if (node_free[l] != npnode) empty_nodes = false;
+				if (empty_nodes){
+					for (unsigned int l=k; l<k+n_span; l++) node_free[l] = 0;
+					first_process = k*npnode;
+					placed = true;
+				}
+			}
+		}
+		else {
+			for (unsigned int k=0; k<n_nodes && !placed; k++){
+				if (node_free[k] >= run_sizes[i]){
+					first_process = k*npnode + node_capacity[k] - node_free[k];
+					node_free[k] -= run_sizes[i];
+					placed = true;
+				}
+			}
+		}
+		if (!placed) return false;
+
+		for (unsigned int p=first_process; p<first_process+run_sizes[i]; p++) pcolors[p] = c;
+		batch_of_run[i] = c;
+		batch_sizes.push_back(run_sizes[i]);
+	}
+
+	return true;
+}
+
+
+
+
+// Assignment of the MD runs to batches of given sizes, longest expected run first, each
+// run going to the batch where it is expected to finish first. Returns the expected time
+// of the batch finishing last.
+template <int dim>
+double STMDSync<dim>::assign_md_runs (std::vector<MDSim<dim> >& md_simulations,
+		std::vector<unsigned int>& batch_sizes, std::vector<int>& batch_of_run)
+{
+	uint32_t n_md_runs = md_simulations.size();
+	const std::vector<double> &nsteps = md_nsteps_of_run;
+
+	std::vector<std::pair<double,int> > md_run_costs;
+	for (uint32_t i=0; i<n_md_runs; ++i){
+		md_run_costs.push_back(std::make_pair(nsteps[i]*predict_md_time_per_step(md_simulations[i], 1), i));
+	}
+	std::stable_sort(md_run_costs.begin(), md_run_costs.end(),
+			[](const std::pair<double,int>& a, const std::pair<double,int>& b){ return a.first > b.first; });
+
+	std::vector<double> batch_time (batch_sizes.size(), 0.);
+	batch_of_run.assign(n_md_runs, -1);
+	for (uint32_t c=0; c<n_md_runs; ++c){
+		int i = md_run_costs[c].second;
+		int best_batch = 0;
+		double best_time = -1.;
+		for (uint32_t b=0; b<batch_sizes.size(); b++){
+			double finish_time = batch_time[b] + nsteps[i]*predict_md_time_per_step(md_simulations[i], batch_sizes[b]);
+			if (best_time < 0. || finish_time < best_time){
+				best_batch = b;
+				best_time = finish_time;
+			}
+		}
+		batch_of_run[i] = best_batch;
+		batch_time[best_batch] = best_time;
+	}
+
+	return *std::max_element(batch_time.begin(), batch_time.end());
+}
+
+
+
+
+// Moving the states held by the processes that are not the root of a batch of the new
+// layout to the root of their new batch (or of the first batch if they are left out of
+// the batches), point to point, so that the states stay in memory or node-local storage
+template <int dim>
+void STMDSync<dim>::migrate_md_states ()
+{
+	const std::vector<int> &batch_roots = md_batch_roots;
+
+	std::vector<int> keys = md_state_cache.keys();
+	int n_states = keys.size()/3;
+	int destination = -1;
+	if (n_states > 0 && (md_batch_pcolor == MPI_UNDEFINED || batch_roots[md_batch_pcolor] != this_mmd_process))
+		destination = (md_batch_pcolor == MPI_UNDEFINED) ? batch_roots[0] : batch_roots[md_batch_pcolor];
+	if (destination == -1) n_states = 0;
+
+	std::vector<int> destinations (mmd_n_processes), n_sent_states (mmd_n_processes);
+	MPI_Allgather(&destination, 1, MPI_INT, &destinations[0], 1, MPI_INT, mmd_communicator);
+	MPI_Allgather(&n_states, 1, MPI_INT, &n_sent_states[0], 1, MPI_INT, mmd_communicator);
+
+	// Each state is sent as its key followed by the flattened state
+	if (destination != -1){
+		for (int k=0; k<n_states; k++){
+			MDState md_state;
+			md_state_cache.load(keys[3*k], keys[3*k+1], keys[3*k+2], md_state);
+
+			std::vector<double> buffer;
+			pack_md_state(md_state, buffer);
+			buffer.insert(buffer.begin(), keys.begin()+3*k, keys.begin()+3*k+3);
+			MPI_Send(&buffer[0], buffer.size(), MPI_DOUBLE, destination, 0, mmd_communicator);
+		}
+		md_state_cache.clear();
+	}
+
+	for (uint32_t p=0; p<mmd_n_processes; p++){
+		if (destinations[p] != this_mmd_process) continue;
+		for (int k=0; k<n_sent_states[p]; k++){
+			MPI_Status status;
+			int buffer_size;
+			MPI_Probe(p, 0, mmd_communicator, &status);
+			MPI_Get_count(&status, MPI_DOUBLE, &buffer_size);
+
+			std::vector<double> buffer (buffer_size);
+			MPI_Recv(&buffer[0], buffer_size, MPI_DOUBLE, p, 0, mmd_communicator, MPI_STATUS_IGNORE);
+
+			MDState md_state;
+			unpack_md_state(&buffer[3], md_state);
+			md_state_cache.store(int(buffer[0]), int(buffer[1]), int(buffer[2]), md_state);
+		}
+	}
 }
 
 
@@ -503,32 +912,29 @@ void STMDSync<dim>::average_replica_data ()
 
 
 template <int dim>
-std::vector< MDSim<dim> > STMDSync<dim>::prepare_md_simulations(ScaleBridgingData scale_bridging_data)
+std::vector< MDSim<dim> > STMDSync<dim>::prepare_md_simulations(const ScaleBridgingData& scale_bridging_data)
 {
 	std::vector< MDSim<dim> > request_simulations;
-	std::vector< QP > update_list = scale_bridging_data.update_list;
+	const std::vector< QPDescriptor >& update_descriptors = scale_bridging_data.update_descriptors;
 
-	uint32_t n_qp = update_list.size();
+	uint32_t n_qp = update_descriptors.size();
 
 	// Number of MD simulations at this iteration...
 	uint32_t nmdruns = n_qp * nrepl;
 
-	// Setting up batch of processes
-	set_md_procs(nmdruns);
+	// ...and their expected number of MD timesteps
+	md_nsteps_of_run.assign(nmdruns, 0.);
 
 	for (uint32_t qp=0; qp<n_qp; ++qp)
 	{
 		for(uint32_t repl=0; repl<nrepl; repl++)
 		{
-			// Allocation of a MD run to a batch of processes
-			//if (md_batch_pcolor == (imdrun%n_md_batches)){
-
 			MDSim<dim> md_sim;
-			md_sim.qp_id = update_list[qp].id;
-			md_sim.most_recent_qp_id = update_list[qp].most_recent_id;
+			md_sim.qp_id = update_descriptors[qp].id;
+			md_sim.most_recent_qp_id = update_descriptors[qp].most_recent_id;
 
 			md_sim.replica = repl + 1; // +1 to match input file lables... fix
-			md_sim.material = update_list[qp].material;
+			md_sim.material = update_descriptors[qp].material;
 
 			int replica_data_index = md_sim.material*nrepl+repl; // imd*nrepl+nrepl;
 			md_sim.matid = replica_data[replica_data_index].mat;
@@ -549,20 +955,9 @@ std::vector< MDSim<dim> > STMDSync<dim>::prepare_md_simulations(ScaleBridgingDat
 			std::string macrostatelocout = input_config.get<std::string>("directory structure.macroscale output");
 			if (approx_md_with_hookes_law == false) md_sim.define_file_names(nanologloc);
 
-			// Argument of the MD simulation: strain to apply
-			SymmetricTensor<2,dim> cg_loc_rep_strain(scale_bridging_data.update_list[qp].update_strain);
-
-			// Rotate strain tensor from common ground to replica orientation
-			md_sim.strain = rotate_tensor(cg_loc_rep_strain, transpose(replica_data[replica_data_index].rotam));
-			// Resize applied strain with initial length of the md sample, the resulting variable is not
-			// a strain but a length variation, which will be transformed back into a strain during the
-			// execution of the MD code where the current length of the nanosystem will be available
-			if (approx_md_with_hookes_law == false){
-				for (unsigned int j=0; j<dim; j++){
-					md_sim.strain[j][j] *= replica_data[replica_data_index].init_length[j];
-					md_sim.strain[j][(j+1)%dim] *= replica_data[replica_data_index].init_length[(j+2)%dim];
-				}
-			}
+			// The strain to apply is only set by the batch running the simulation, its norm
+			// is enough to plan the simulations
+			md_nsteps_of_run[qp*nrepl+repl] = estimate_md_nsteps(md_sim, update_descriptors[qp].strain_norm);
 
 			// Setting up md system stiffness tensor
 			md_sim.stiffness = replica_data[replica_data_index].init_stiff;
@@ -571,159 +966,269 @@ std::vector< MDSim<dim> > STMDSync<dim>::prepare_md_simulations(ScaleBridgingDat
 		}
 	}
 
+	// Setting up batch of processes (keeping the previous ones if no run is needed)
+	if (nmdruns > 0) set_md_procs(request_simulations);
+
 	return request_simulations;
 }
 
 
 
+// Argument of the MD simulations run by this batch: strain to apply, received by the
+// root of the batch from the FE processes owning the quadrature points
 template <int dim>
-void STMDSync<dim>::execute_inside_md_simulations(std::vector<MDSim<dim> >& md_simulations)
+void STMDSync<dim>::set_md_strains(std::vector<MDSim<dim> >& md_simulations,
+		ScaleBridgingData& scale_bridging_data)
+{
+	scale_bridging_data.build_update_index();
+
+	for (uint32_t c=0; c<md_local_queue.size(); ++c)
+	{
+		MDSim<dim>& md_sim = md_simulations[md_local_queue[c]];
+		int replica_data_index = md_sim.material*nrepl + md_sim.replica-1;
+
+		SymmetricTensor<2,dim> cg_loc_rep_strain(scale_bridging_data.get_qp_with_id(md_sim.qp_id).update_strain);
+
+		// Rotate strain tensor from common ground to replica orientation
+		md_sim.strain = rotate_tensor(cg_loc_rep_strain, transpose(replica_data[replica_data_index].rotam));
+		// Resize applied strain with initial length of the md sample, the resulting variable is not
+		// a strain but a length variation, which will be transformed back into a strain during the
+		// execution of the MD code where the current length of the nanosystem will be available
+		if (approx_md_with_hookes_law == false){
+			for (unsigned int j=0; j<dim; j++){
+				md_sim.strain[j][j] *= replica_data[replica_data_index].init_length[j];
+				md_sim.strain[j][(j+1)%dim] *= replica_data[replica_data_index].init_length[(j+2)%dim];
+			}
+		}
+	}
+}
+
+
+
+// The batch of every MD run is decided once, before the strains are sent to the roots of the
+// batches: runs restarting from a cached state go to the batch holding it, runs of an heterogeneous
+// layout to the batch sized for them, and the others, longest expected first, to the batch
+// expected to complete them first
+template <int dim>
+void STMDSync<dim>::dispatch_md_simulations(std::vector<MDSim<dim> >& md_simulations)
 {
-	// Computing cell state update running one simulation per MD replica (basic job scheduling and executing)
-	mcout << "        " << "...dispatching the MD runs on batch of processes..." << std::endl;
-	mcout << "        " << "...cells and replicas completed: " << std::flush;
 	uint32_t n_md_runs = md_simulations.size();
 
+	// Gathering the keys of the states held by the root process of every batch
+	std::vector<int> local_keys;
+	if (md_batch_communicator != MPI_COMM_NULL && this_md_batch_process == 0)
+		local_keys = md_state_cache.keys();
+
+	int n_local_keys = local_keys.size();
+	std::vector<int> n_keys (mmd_n_processes);
+	MPI_Allgather(&n_local_keys, 1, MPI_INT, &n_keys[0], 1, MPI_INT, mmd_communicator);
+
+	std::vector<int> displs (mmd_n_processes, 0);
+	for (uint32_t p=1; p<mmd_n_processes; p++) displs[p] = displs[p-1] + n_keys[p-1];
+	int n_all_keys = displs[mmd_n_processes-1] + n_keys[mmd_n_processes-1];
+
+	std::vector<int> all_keys (n_all_keys+1);
+	MPI_Allgatherv(local_keys.data(), n_local_keys, MPI_INT,
+			&all_keys[0], &n_keys[0], &displs[0], MPI_INT, mmd_communicator);
+
+	std::map<MDStateCache::Key, int> state_batch;
+	for (uint32_t p=0; p<mmd_n_processes; p++)
+		for (int k=displs[p]; k<displs[p]+n_keys[p]; k+=3)
+			state_batch[MDStateCache::Key(all_keys[k], all_keys[k+1], all_keys[k+2])] = md_batch_pcolors[p];
+
+	// Expected cost of each run, from its number of MD timesteps and the measured
+	// cost of a timestep of its replica
+	std::vector<std::pair<double,int> > md_run_costs;
 	for (uint32_t i=0; i<n_md_runs; ++i)
+		md_run_costs.push_back(std::make_pair(md_nsteps_of_run[i]*predict_md_time_per_step(md_simulations[i], 1), i));
+	// Longest expected runs first, stable with respect to the order of the update list
+	std::stable_sort(md_run_costs.begin(), md_run_costs.end(),
+			[](const std::pair<double,int>& a, const std::pair<double,int>& b){ return a.first > b.first; });
+
+	md_batch_of_run.assign(n_md_runs, -1);
+	std::vector<double> batch_time (n_md_batches, 0.);
+	for (uint32_t c=0; c<n_md_runs; ++c)
 	{
-		// Allocation of a MD run to a batch of processes
-		if (md_batch_pcolor == (i%n_md_batches)){
-			// Executing from an external MPI_Communicator (avoids failure of the main communicator
-			// when the specific/external communicator fails)
-			// Does not work as OpenMPI cannot be started from an existing OpenMPI run...
-			/*std::string exec_name = "mpirun ./single_md";
-
-					// Writting the argument list to be passed to the strain_md executable directly
-					std::vector<std::string> args_list_separator = " ";
-					std::string args_list;
-					for (int i=0; i<md_args[imdrun].size(); i++){
-						args_list += args_list_separator+md_args[i];
-					}
+		int i = md_run_costs[c].second;
 
-					std::string redir_output = " > " + qpreplogloc[imdrun] + "/out.single_md";
+		int load_qp_id = md_simulations[i].qp_id;
+		if (md_simulations[i].qp_id != md_simulations[i].most_recent_qp_id)
+			load_qp_id = md_simulations[i].most_recent_qp_id;
 
-					std::string command = exec_name+args_list+redir_output;
-					int ret = system(command.c_str());
-					if (ret!=0){
-						std::cerr << "Failed executing the md simulation: " << command << std::endl;
-						exit(1);
-					}*/
+		std::map<MDStateCache::Key, int>::const_iterator it = state_batch.find(
+				MDStateCache::Key(load_qp_id, md_simulations[i].material, md_simulations[i].replica));
+		int batch = -1;
+		if (it != state_batch.end()) batch = it->second;
+		else if (md_planned_batch_of_run.size() > 0) batch = md_planned_batch_of_run[i];
+		if (batch == -1) continue;
 
-			// Executing directly from the current MPI_Communicator (not fault tolerant)
-
-			//MPI_Barrier(mmd_communicator);
-			STMDProblem<3> stmd_problem (md_batch_communicator, md_batch_pcolor);
+		md_batch_of_run[i] = batch;
+		batch_time[batch] += md_nsteps_of_run[i]*predict_md_time_per_step(md_simulations[i], md_batch_sizes[batch]);
+	}
 
-			stmd_problem.strain(md_simulations[i], approx_md_with_hookes_law);
+	for (uint32_t c=0; c<n_md_runs; ++c)
+	{
+		int i = md_run_costs[c].second;
+		if (md_batch_of_run[i] != -1) continue;
+
+		int best_batch = 0;
+		double best_time = -1.;
+		for (uint32_t b=0; b<n_md_batches; b++){
+			double finish_time = batch_time[b]
+					+ md_nsteps_of_run[i]*predict_md_time_per_step(md_simulations[i], md_batch_sizes[b]);
+			if (best_time < 0. || finish_time < best_time){
+				best_batch = b;
+				best_time = finish_time;
+			}
 		}
+		md_batch_of_run[i] = best_batch;
+		batch_time[best_batch] = best_time;
 	}
-	mcout << std::endl;
 
-	MPI_Barrier(mmd_communicator);
+	md_local_queue.clear();
+	for (uint32_t c=0; c<n_md_runs; ++c)
+		if (md_batch_of_run[md_run_costs[c].second] == md_batch_pcolor)
+			md_local_queue.push_back(md_run_costs[c].second);
+}
+
+
+
+// Number of timesteps of the straining, computed as in STMDProblem::lammps_straining from
+// the norm of the strain (rotating it to the replica orientation leaves it unchanged), plus
+// the timesteps of the homogenization
+template <int dim>
+double STMDSync<dim>::estimate_md_nsteps(MDSim<dim>& md_sim, double strain_norm)
+{
+	double strain_time = strain_norm / md_sim.strain_rate;
+	int nts = std::ceil( (strain_time/md_sim.timestep_length) /10.0) * 10;
+	nts = std::max(nts,10);
 
+	return double(nts + md_sim.nsteps_sample);
 }
 
+
+
+// Expected wall-time of a MD timestep of the replica on a given number of processes,
+// averaged over the other replicas if it has not been measured yet
 template <int dim>
-void STMDSync<dim>::share_stresses(std::vector<MDSim<dim> >& md_simulations)
+double STMDSync<dim>::predict_md_time_per_step(MDSim<dim>& md_sim, unsigned int nprocs)
 {
-	// share all the stresses calculated in different batches to rank 0
+	MDScalingModel& model = md_scaling_models[md_sim.material*nrepl + md_sim.replica-1];
+	if (model.measured()) return model.time_per_step(nprocs);
+
+	double time_per_step = 0.;
+	int n_measured = 0;
+	for (uint32_t r=0; r<md_scaling_models.size(); r++){
+		if (md_scaling_models[r].measured()){
+			time_per_step += md_scaling_models[r].time_per_step(nprocs);
+			n_measured++;
+		}
+	}
+	if (n_measured > 0) return time_per_step/n_measured;
+
+	// Nothing measured yet, perfect scaling of a unit cost
+	return 1./nprocs;
+}
+
 
-	MPI_Request  request;
-	MPI_Status 	 status;
 
+template <int dim>
+void STMDSync<dim>::update_md_cost_model(std::vector<MDSim<dim> >& md_simulations)
+{
 	uint32_t n_md_runs = md_simulations.size();
 
-	std::vector<int> pcolors(mmd_n_processes);
-	for (unsigned int i=0; i<mmd_n_processes; i++){
-		pcolors[i] = int(i/md_batch_n_processes); // this is the commmand in set_md_procs
-	}
+	// Wall-time of every run is only known by the root of the batch that executed it
+	MPI_Allreduce(MPI_IN_PLACE, &md_walltime_of_run[0], n_md_runs, MPI_DOUBLE, MPI_MAX, mmd_communicator);
 
-	if (pcolors[0] != 0){
-		std::cout << "Error: root rank has pcolor != 0" << std::endl;
-		exit(1);
+	// Fitting the strong-scaling model of each replica with the new measures
+	for (uint32_t i=0; i<n_md_runs; ++i)
+	{
+		if (md_walltime_of_run[i] <= 0.) continue;
+
+		md_scaling_models[md_simulations[i].material*nrepl + md_simulations[i].replica-1].add_measure(
+				md_batch_sizes[md_batch_of_run[i]], md_walltime_of_run[i]/md_nsteps_of_run[i]);
 	}
+}
 
-	// for eah batch, send stresses it calculated to rank 0
-	for (int32_t	pcolor=1; pcolor<n_md_batches; pcolor++){
-
-		// find lowest rank in this batch - this will be used to send the batch's information
-		int32_t batch_root;
-		bool found = false;
-		for (uint32_t i=0; i<mmd_n_processes; i++){
-			if (pcolors[i] == pcolor){
-				batch_root = i;
-				found = true;
-				break;
-			}
-		}
-		assert(found==true);
-
-		// number of sims to share from this batch
-		uint32_t n_sends = 0;
-		if (this_mmd_process == batch_root){
-			for (uint32_t i=0; i<n_md_runs; i++){
-				if (md_simulations[i].stress_updated == true){
-					n_sends++ ;
-				}
-			}
-		}
-		MPI_Bcast(&n_sends, 1, MPI_INT, batch_root, mmd_communicator);
-
-		// ids of sims to share from this batch
-		//int md_send_indexes[n_sends];
-		std::vector<uint32_t> md_send_indexes(n_sends);
-		uint32_t count = 0;
-		if (this_mmd_process == batch_root){
-			for (uint32_t i=0; i<n_md_runs; i++){
-				if (md_simulations[i].stress_updated == true){
-					md_send_indexes[count] = i;
-					count++;
-				}
-			}
+
+
+template <int dim>
+void STMDSync<dim>::execute_inside_md_simulations(std::vector<MDSim<dim> >& md_simulations)
+{
+	// Computing cell state update running one simulation per MD replica (job scheduling planned before
+	// the strains are received, and executing)
+	mcout << "        " << "...dispatching the MD runs on batch of processes..." << std::endl;
+	mcout << "        " << "...cells and replicas completed: " << std::flush;
+	uint32_t n_md_runs = md_simulations.size();
+
+	md_walltime_of_run.assign(n_md_runs, 0.);
+
+	uint32_t local_queue_position = 0;
+	while (md_batch_communicator != MPI_COMM_NULL)
+	{
+		// Allocation of a MD run to a batch of processes: next run of the local queue,
+		// whose strain is only known by the root of the batch
+		int i = -1;
+		if (this_md_batch_process == 0 && local_queue_position < md_local_queue.size()){
+			i = md_local_queue[local_queue_position];
+			local_queue_position++;
 		}
-		MPI_Bcast(&md_send_indexes[0], n_sends, MPI_INT, batch_root, mmd_communicator);
-
-		// for each md run calculated on this batch
-		for (uint32_t i=0; i<n_sends; i++){
-			uint32_t md_run_index = md_send_indexes[i];
-
-			// share stresses calculated to rank 0
-			if (this_mmd_process == batch_root){
-				//build array to send
-				double send_stress[6];
-				for (uint32_t j=0; j<6; j++){
-					send_stress[j] = md_simulations[md_run_index].stress.access_raw_entry(j);
+		MPI_Bcast(&i, 1, MPI_INT, 0, md_batch_communicator);
+		if (i == -1) break;
+
+		double md_strain[SymmetricTensor<2,dim>::n_independent_components];
+		for (uint32_t j=0; j<SymmetricTensor<2,dim>::n_independent_components; j++)
+			md_strain[j] = md_simulations[i].strain.access_raw_entry(j);
+		MPI_Bcast(md_strain, SymmetricTensor<2,dim>::n_independent_components, MPI_DOUBLE, 0, md_batch_communicator);
+		for (uint32_t j=0; j<SymmetricTensor<2,dim>::n_independent_components; j++)
+			md_simulations[i].strain.access_raw_entry(j) = md_strain[j];
+
+		// Executing from an external MPI_Communicator (avoids failure of the main communicator
+		// when the specific/external communicator fails)
+		// Does not work as OpenMPI cannot be started from an existing OpenMPI run...
+		/*std::string exec_name = "mpirun ./single_md";
+
+				// Writting the argument list to be passed to the strain_md executable directly
+				std::vector<std::string> args_list_separator = " ";
+				std::string args_list;
+				for (int i=0; i<md_args[imdrun].size(); i++){
+					args_list += args_list_separator+md_args[i];
 				}
-				//send to rank 0
-				MPI_Isend(&send_stress[0], 6, MPI_DOUBLE, 0, md_run_index, mmd_communicator, &request);
 
-			} else if (this_mmd_process == 0){
-				//recieve stress and convert to symmetric tensor
-				double recv_stress[6];
-				MPI_Recv(&recv_stress[0], 6, MPI_DOUBLE, batch_root, md_run_index, mmd_communicator, &status);
-				SymmetricTensor<2,dim> stress(recv_stress);
+				std::string redir_output = " > " + qpreplogloc[imdrun] + "/out.single_md";
 
-				md_simulations[md_run_index].stress = stress;
-				md_simulations[md_run_index].stress_updated = true;
-			}
-		}
-	}
+				std::string command = exec_name+args_list+redir_output;
+				int ret = system(command.c_str());
+				if (ret!=0){
+					std::cerr << "Failed executing the md simulation: " << command << std::endl;
+					exit(1);
+				}*/
 
-	// Check all stresses are set on rank 0
-	if (this_mmd_process == 0){
-		for (uint32_t i=0; i<md_simulations.size(); i++){
-			if (md_simulations[i].stress_updated != true){
-				for (uint32_t j=0; j<6; j++){
-					std::cout << md_simulations[i].stress.access_raw_entry(j) << " ";
-				} std::cout << std::endl;
-				std::cout << "Stress not set or not communicated to rank ("<<this_mmd_process<<") . "
-						<< md_simulations[i].qp_id <<std::endl;
-				exit(1);
-			}
+		// Executing directly from the current MPI_Communicator (not fault tolerant)
+		// using the MD engine of the batch
+
+		//MPI_Barrier(mmd_communicator);
+		double start_walltime = MPI_Wtime();
+		stmd_problem->strain(md_simulations[i], approx_md_with_hookes_law);
+
+		if (this_md_batch_process == 0){
+			md_walltime_of_run[i] = MPI_Wtime() - start_walltime;
 		}
 	}
-}
+	mcout << std::endl;
+
+	update_md_cost_model(md_simulations);
+
+	// States of the runs executed by the other batches are now outdated in this cache
+	if (md_batch_communicator != MPI_COMM_NULL && this_md_batch_process == 0)
+		for (uint32_t i=0; i<n_md_runs; ++i)
+			if (md_batch_pcolor != md_batch_of_run[i])
+				md_state_cache.evict(md_simulations[i].qp_id, md_simulations[i].material,
+						md_simulations[i].replica);
 
+	MPI_Barrier(mmd_communicator);
+
+}
 
 template <int dim>
 void STMDSync<dim>::write_exec_script_md_job()
@@ -849,93 +1354,48 @@ void STMDSync<dim>::execute_pjm_md_simulations()
 	}
 }
 
+// Each replica contributes to the stress averaged over the replicas with the stress of its
+// MD simulation, minus its initial stress, rotated to the common ground direction. These
+// contributions are only stored by the root of the batch that ran the simulations, and sent
+// from there to the FE processes requesting them.
 template <int dim>
-int get_sim_id(std::vector<MDSim<dim> > md_simulations, int qp_id, int rep)
-{
-	// find md_simulation for qp_id and rep
-	int n_md_sim = md_simulations.size();
-	int md_index;
-	bool found = false;
-	for (int i=0; i<n_md_sim; i++){
-		if (md_simulations[i].qp_id == qp_id && md_simulations[i].replica == rep){
-			md_index = i;
-			found = true;
-			break;
-		}
-	}
-	if (found != true){
-		std::cout<< "Error: MDSim not found for qp "<< qp_id <<" replica "<< rep <<std::endl;
-		exit(1);
-	}
-	return md_index;
-}
-
-template <int dim>
-void STMDSync<dim>::store_md_simulations(std::vector<MDSim<dim> > md_simulations,
+void STMDSync<dim>::store_md_simulations(const std::vector<MDSim<dim> >& md_simulations,
 		ScaleBridgingData& scale_bridging_data)
 		{
-	MDSim<dim> md_simulation;
-	int n_qp = scale_bridging_data.update_list.size();
-	// Averaging stiffness and stress per cell over replicas
-	for (int qp=0; qp<n_qp; qp++){
-		int qp_id = scale_bridging_data.update_list[qp].id;
-
-		//if (this_mmd_process == int(c%mmd_n_processes))// ????????????
-		//{
-		SymmetricTensor<2,dim> cg_loc_stress;
+	if (md_batch_communicator == MPI_COMM_NULL || this_md_batch_process != 0) return;
 
-		for (uint32_t rep=0; rep<nrepl; rep++){
-			uint32_t numrepl = rep + 1;
-			uint32_t md_sim_id = get_sim_id(md_simulations, qp_id, numrepl);
+	for (uint32_t c=0; c<md_local_queue.size(); c++){
+		const MDSim<dim>& md_simulation = md_simulations[md_local_queue[c]];
 
-			md_simulation = md_simulations[md_sim_id];
-
-			uint32_t replica_data_index = md_simulation.material * nrepl + rep;
+		if (md_simulation.stress_updated != true && use_pjm_scheduler == false){
+			std::cout << "Stress not set on the root of batch ("<<md_batch_pcolor<<") . "
+					<< md_simulation.qp_id <<std::endl;
+			exit(1);
+		}
 
-			SymmetricTensor<2,dim> cg_loc_rep_stress, loc_rep_stress;
+		uint32_t replica_data_index = md_simulation.material * nrepl + md_simulation.replica-1;
 
-			// stress from most recent md simulation
-			loc_rep_stress = md_simulation.stress;
+		SymmetricTensor<2,dim> cg_loc_rep_stress, loc_rep_stress;
 
-			// subtract the intial stress in the starting structure
-			if (approx_md_with_hookes_law == false){
-				loc_rep_stress -= replica_data[replica_data_index].init_stress;
-			}
+		// stress from most recent md simulation
+		loc_rep_stress = md_simulation.stress;
 
-			// Rotation of the stress tensor to common ground direction before averaging
-			cg_loc_rep_stress = rotate_tensor(loc_rep_stress, replica_data[replica_data_index].rotam);
-
-			cg_loc_stress += cg_loc_rep_stress;
-
-			//if (use_pjm_scheduler){
-			//	std::string scriptfile = nanostatelocout + "/" + "bash_cell"+cell_id[c]
-			//											 +"_repl"+std::to_string(numrepl)+".sh";
-			//	remove(scriptfile.c_str());
-			//}
-
-			// Clean "nanoscale_logs" of the finished timestep
-			/*if (approx_md_with_hookes_law == false){
-				char command[1024];
-				sprintf(command, "rm -rf %s", md_simulation.log_file.c_str());
-			}*/
-			//std::cout<< "Logfile "<< md_simulation.log_file <<std::endl;
-			//int ret = system(command);
-			//if (ret!=0){
-			//	std::cout << "Failed removing the log files of the MD simulation: " << md_simulation.log_file << std::endl;
-			//}
-			//}
+		// subtract the intial stress in the starting structure
+		if (approx_md_with_hookes_law == false){
+			loc_rep_stress -= replica_data[replica_data_index].init_stress;
 		}
-		cg_loc_stress /= nrepl;
 
-		/*std::cout<< "STORING rep averages"<<std::endl;
-	    for (int i=0; i<6; i++){
-        std::cout << " " << cg_loc_stress.access_raw_entry(i);
-      } std::cout << std::endl;		*/
+		// Rotation of the stress tensor to common ground direction before averaging
+		cg_loc_rep_stress = rotate_tensor(loc_rep_stress, replica_data[replica_data_index].rotam);
+		cg_loc_rep_stress /= nrepl;
 
-		// serialse qp stress into scale bridging data array
+		// serialse replica contribution into scale bridging data array
+		QPStress replica_stress;
+		replica_stress.id = md_simulation.qp_id;
 		for (uint32_t i=0; i<6; i++){
-			scale_bridging_data.update_list[qp].update_stress[i] = cg_loc_stress.access_raw_entry(i);
+			replica_stress.update_stress[i] = cg_loc_rep_stress.access_raw_entry(i);
 		}
+		scale_bridging_data.replica_stress_list.push_back(replica_stress);
 	}
 		}
 
@@ -976,6 +1436,16 @@ void STMDSync<dim>::init (int sstp, double mdtlength, double mdtemp, int nss, do
 	nrepl = nr;
 
 	use_pjm_scheduler = ups;
+
+	md_scaling_models.assign(mdtype.size()*nrepl, MDScalingModel());
+
+	// Sizing each MD batch from the expected cost of its run
+	heterogeneous_md_batches = input_config.get<bool>("computational resources.heterogeneous md batches", false);
+	md_batch_layout_tolerance = input_config.get<double>("computational resources.batch layout tolerance", 0.2);
+
+	// Node-local directory to spill the cached atomistic states to, if any
+	md_state_cache_directory = input_config.get<std::string>("molecular dynamics parameters.state cache directory", "none");
+
 	restart ();
 	load_replica_generation_data();
 	load_replica_equilibration_data();
@@ -986,7 +1456,7 @@ void STMDSync<dim>::init (int sstp, double mdtlength, double mdtemp, int nss, do
 }
 
 template <int dim>
-void STMDSync<dim>::update (int tstp, double ptime, int nstp, ScaleBridgingData& scale_bridging_data){
+void STMDSync<dim>::plan (int tstp, double ptime, int nstp, ScaleBridgingData& scale_bridging_data){
 	present_time = ptime;
 	timestep = tstp;
 	newtonstep = nstp;
@@ -1004,38 +1474,52 @@ void STMDSync<dim>::update (int tstp, double ptime, int nstp, ScaleBridgingData&
 	if (timestep%freq_checkpoint==0) checkpoint_save = true;
 	else checkpoint_save = false;
 
-	std::vector< MDSim<dim> > md_simulations;
-	md_simulations = prepare_md_simulations(scale_bridging_data);
+	// Every MD process plans the MD runs from the description of all the updates
+	std::vector<QPDescriptor>& update_descriptors = scale_bridging_data.update_descriptors;
+	int n_updates = update_descriptors.size();
+	MPI_Bcast(&n_updates, 1, MPI_INT, 0, mmd_communicator);
+	update_descriptors.resize(n_updates);
+	MPI_Bcast(update_descriptors.data(), n_updates, MPI_QP_DESCRIPTOR, 0, mmd_communicator);
+	scale_bridging_data.build_descriptor_index();
+
+	md_runs = prepare_md_simulations(scale_bridging_data);
+
+	int n_md = md_runs.size();
+	if (n_md>0) dispatch_md_simulations(md_runs);
+
+	scale_bridging_data.run_processes.resize(n_md);
+	for (int i=0; i<n_md; i++)
+		scale_bridging_data.run_processes[i] = md_batch_roots[md_batch_of_run[i]];
+}
 
+template <int dim>
+void STMDSync<dim>::update (ScaleBridgingData& scale_bridging_data){
 	MPI_Barrier(mmd_communicator);
-	int n_md = md_simulations.size();
+	int n_md = md_runs.size();
 	mcout << "        Running " << n_md << " simulations:\n";
 	for (int i=0; i<n_md; i++){
-		mcout << md_simulations[i].qp_id <<"-"<<md_simulations[i].replica << " ";
+		mcout << md_runs[i].qp_id <<"-"<<md_runs[i].replica << " ";
 		//mcout << i << " ";
 		//for (int j=0; j<6; j++){
-		//   mcout << " " << md_simulations[i].strain.access_raw_entry(j);
+		//   mcout << " " << md_runs[i].strain.access_raw_entry(j);
 		//} mcout << std::endl;
 	}
 	mcout << std::endl;
 
 	if (n_md>0){
+		// The root of each batch holds the strains of the updates it runs
+		if (md_batch_communicator != MPI_COMM_NULL && this_md_batch_process == 0)
+			set_md_strains(md_runs, scale_bridging_data);
+
 		if(use_pjm_scheduler){
 			execute_pjm_md_simulations();
 		}
 		else{
-			execute_inside_md_simulations(md_simulations);
-
-			MPI_Barrier(mmd_communicator);
-
-			share_stresses(md_simulations);
-		}
-
-		//average stresses over md replicas, and store them in scale_bridging_data
-		if (this_mmd_process == 0){
-			store_md_simulations(md_simulations, scale_bridging_data);
+			execute_inside_md_simulations(md_runs);
 		}
 
+		// contributions of the replicas to the averaged stresses, stored in scale_bridging_data
+		store_md_simulations(md_runs, scale_bridging_data);
 	}
 }
 }
@@ -4,12 +4,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <set>
+#include <algorithm>
+#include <limits>
+#include <iostream>
 #include <stdint.h>
 #include <fstream>
 #include <math.h>
 
-#include "spline.h"
-
 /**
  * This file implements the comparison (L2 norm) between the strain histories of every gauss point
  * in the finite element mesh, across all ranks.
@@ -22,10 +24,10 @@
  * is that each Strain6D object obtains a list of all the other Strain6D objects which are within
  * a certain threshold similarity.
  *
- * These similarities can be passed to the coarsegrain_dependency_network.py script, in which a
- * a dependency graph is created. The graph is iteratively reduced by culling the node with the
- * highest degree (and assigning all neighbours to get their results from the corresponding gauss
- * point's MD simulation) until all nodes are accounted for.
+ * These similarities are then passed to coarsegrain_dependency_network(), in which a dependency
+ * graph is created. The graph is iteratively reduced by culling the node with the highest degree
+ * (and assigning all neighbours to get their results from the corresponding gauss point's MD
+ * simulation) until all nodes are accounted for.
  */
 namespace MatHistPredict {
 
@@ -50,6 +52,9 @@ namespace MatHistPredict {
             {
                 up_to_date = false;
                 num_steps_added = 0;
+                num_knots = 0;
+                knot_stride = 1;
+                max_num_knots = 0;
                 num_spline_points_per_component = 0;
 
                 ID = std::numeric_limits<uint32_t>::max(); // Should be set correctly using set_ID()
@@ -71,33 +76,45 @@ namespace MatHistPredict {
                 this->ID_is_set = true;
             }
 
+            /* Bound the number of strain states stored in this history to max_num_knots (0 for an unbounded history).
+             * Once the bound is reached, every other stored state is dropped and only one step out of two is stored
+             * from then on: the stored states remain equally spaced over the whole history, with a resolution halved
+             * each time the bound is reached, and the memory of the history no longer grows with the number of steps.
+             * Decimation only drops knots inside the history: the most recent strain step is always the last knot of
+             * the spline, whether it is stored or not, so the spline never lags behind the history. All the histories
+             * of a simulation receive the same steps, so they keep the same resolution and remain comparable with each
+             * other.
+             */
+            void set_max_history_length(uint32_t max_num_knots)
+            {
+                if(max_num_knots != 0 && max_num_knots < 8) {
+                    fprintf(stderr, "Error: A bounded strain history must hold at least 8 strain states.\n");
+                    exit(1);
+                }
+                if(num_steps_added > 0) {
+                    fprintf(stderr, "Error: The length of a strain history must be bounded before adding strain steps.\n");
+                    exit(1);
+                }
+
+                this->max_num_knots = max_num_knots;
+                for(uint32_t c = 0; c < 6; c++) {
+                    in_component(c).reserve(max_num_knots);
+                    elim_d[c].reserve(max_num_knots);
+                }
+                elim_c.reserve(max_num_knots);
+            }
+
             /* Add a new strain state to this history */
             void add_current_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz)
             {
-                up_to_date = false;
-
-                in_XX.push_back(strain_xx);
-                in_YY.push_back(strain_yy);
-                in_ZZ.push_back(strain_zz);
-                in_XY.push_back(strain_xy);
-                in_XZ.push_back(strain_xz);
-                in_YZ.push_back(strain_yz);
-                num_steps_added++;
+                append_strain(strain_xx, strain_yy, strain_zz, strain_xy, strain_xz, strain_yz);
             }
 
             /* Add a new strain state, and the associated stress (only needed for testing with ML techniques) */
             void add_current_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz,
                         double stress_xx, double stress_yy, double stress_zz, double stress_xy, double stress_xz, double stress_yz)
             {
-                up_to_date = false;
-
-                in_XX.push_back(strain_xx);
-                in_YY.push_back(strain_yy);
-                in_ZZ.push_back(strain_zz);
-                in_XY.push_back(strain_xy);
-                in_XZ.push_back(strain_xz);
-                in_YZ.push_back(strain_yz);
-                num_steps_added++;
+                append_strain(strain_xx, strain_yy, strain_zz, strain_xy, strain_xz, strain_yz);
 
                 // Also keep track of most recent stress
                 this->stress[0] = stress_xx;
@@ -121,14 +138,7 @@ namespace MatHistPredict {
                 double xx, yy, zz, xy, xz, yz;
                 while (infile >> xx >> yy >> zz >> xy >> xz >> yz)
                 {
-                    in_XX.push_back(xx);
-                    in_YY.push_back(yy);
-                    in_ZZ.push_back(zz);
-                    in_XY.push_back(xy);
-                    in_XZ.push_back(xz);
-                    in_YZ.push_back(yz);
-
-                    num_steps_added++;
+                    append_strain(xx, yy, zz, xy, xz, yz);
                 }
                 infile.close();
             }
@@ -136,45 +146,80 @@ namespace MatHistPredict {
             /* Build a spline out of the strain steps that have been read-in so far (must be at least 3 steps).
              * Each component is represented by num_spline_points_per_component equally spaced points along the
              * spline. The total number of points in the final strain vector is therefore num_spline_points_per_component * 6.
+             *
+             * The natural cubic spline through the history (steps equally spaced over [0,1]) is not refitted: the
+             * forward elimination of its tridiagonal system is kept up to date as steps are added (see append_strain()),
+             * and only the back substitution near the knots around each spline point is carried out here. The
+             * influence of a knot decays by a factor 2-sqrt(3) per knot in the back substitution, so it is
+             * truncated after backsubst_window knots without loss of accuracy, and the cost does not depend
+             * on the number of steps in the history.
+             *
+             * For a bounded history, the most recent step is added as a last knot after the stored ones when it
+             * is not stored itself (the last interval being then shorter than the others), so that the spline
+             * always covers the whole history.
              */
             void splinify(uint32_t num_spline_points_per_component)
             {
-                if(num_steps_added == 0) {
+                uint32_t tail_steps = (num_knots > 0) ? num_steps_added - 1 - (num_knots - 1)*knot_stride : 0;
+                uint32_t n = num_knots + ((tail_steps > 0) ? 1 : 0);
+
+                if(n == 0) {
                     fprintf(stderr, "Error: Nothing to splinify! No strain data has been read in yet. Please use .from_file() or .add_current_strain() first.\n");
                     exit(1);
-                } else if(num_steps_added < 3) {
+                } else if(n < 3) {
                     fprintf(stderr, "Error: Not enough strain steps added. Need at least 3 points for splinify().\n");
                     exit(1);
                 }
 
                 this->num_spline_points_per_component = num_spline_points_per_component;
 
-                tk::spline splXX, splYY, splZZ, splXY, splXZ, splYZ;
-
-                // Set splines
-                std::vector<double> T;
-                for(uint32_t n = 0; n < num_steps_added; n++) {
-                    double t = (double)n/(double)(num_steps_added - 1);
-                    T.push_back(t);
+                uint32_t last = num_knots - 1; // last stored knot
+                double num_intervals = (double)(num_steps_added - 1);
+                double dx = (double)knot_stride/num_intervals;
+
+                // Solution of the spline system at the last stored knot (zero if it is the end of the spline,
+                // otherwise given by the row of this knot, which has a shorter interval on its right)
+                double z_last[6] = {0, 0, 0, 0, 0, 0};
+                if(tail_steps > 0) {
+                    double rho = (double)tail_steps/(double)knot_stride;
+                    for(uint32_t c = 0; c < 6; c++) {
+                        std::vector<double>& y = in_component(c);
+                        double rhs = (tail_strain[c] - y[last])/rho - y[last] + y[last - 1];
+                        z_last[c] = (rhs - elim_d[c][last - 1])/(2.0*(1.0 + rho) - elim_c[last - 1]);
+                    }
                 }
 
-                splXX.set_points(T,in_XX);
-                splYY.set_points(T,in_YY);
-                splZZ.set_points(T,in_ZZ);
-                splXY.set_points(T,in_XY);
-                splXZ.set_points(T,in_XZ);
-                splYZ.set_points(T,in_YZ);
-
                 spline.clear(); // reset the existing spline result to zero
                 spline.reserve(num_spline_points_per_component * 6); // mult by 6 because there are 6 components
-                for(uint32_t n = 0; n < num_spline_points_per_component; n++) {
-                    double t = (double)n/(double)(num_spline_points_per_component - 1);
-                    spline.push_back(splXX(t));
-                    spline.push_back(splYY(t));
-                    spline.push_back(splZZ(t));
-                    spline.push_back(splXY(t));
-                    spline.push_back(splXZ(t));
-                    spline.push_back(splYZ(t));
+                for(uint32_t m = 0; m < num_spline_points_per_component; m++) {
+                    double t = (double)m/(double)(num_spline_points_per_component - 1);
+
+                    // Interval [T_k, T_k+1] such that T_k < t <= T_k+1 (first interval if t = 0)
+                    int32_t j = std::min((int32_t)ceil(t * num_intervals/(double)knot_stride), (int32_t)n - 1);
+                    while(j > 0 && knot_position(j - 1, n) >= t) j--;
+                    while(j < (int32_t)n - 1 && knot_position(j, n) < t) j++;
+                    uint32_t k = (j > 0) ? j - 1 : 0;
+                    double h = t - knot_position(k, n);
+
+                    for(uint32_t c = 0; c < 6; c++) {
+                        std::vector<double>& y = in_component(c);
+
+                        // Spline coefficients over the interval (b being half the second derivative)
+                        double b_k = 3.0 * second_derivative_factor(c, k, z_last[c]) / (dx*dx);
+                        double a_k, c_k;
+                        if(k < last) {
+                            double b_k1 = 3.0 * second_derivative_factor(c, k + 1, z_last[c]) / (dx*dx);
+                            a_k = 1.0/3.0*(b_k1 - b_k)/dx;
+                            c_k = (y[k + 1] - y[k])/dx - 1.0/3.0*(2.0*b_k + b_k1)*dx;
+                        } else {
+                            // Interval up to the most recent step (natural end of the spline)
+                            double dx_tail = (double)tail_steps/num_intervals;
+                            a_k = -1.0/3.0*b_k/dx_tail;
+                            c_k = (tail_strain[c] - y[k])/dx_tail - 1.0/3.0*2.0*b_k*dx_tail;
+                        }
+
+                        spline.push_back(((a_k*h + b_k)*h + c_k)*h + y[k]);
+                    }
                 }
                 up_to_date = true;
             }
@@ -237,13 +282,14 @@ namespace MatHistPredict {
             }
 
 
-            /* For legacy reasons only */
+            /* For legacy reasons only. Only the histories within threshold difference are considered, so the
+             * ID is std::numeric_limits<uint32_t>::max() if there is none. */
             uint32_t get_most_similar_history_ID()
             {
                 return most_similar_history.ID;
             }
 
-            /* For legacy reasons only */
+            /* For legacy reasons only. Infinity if no history is within threshold difference. */
             double get_most_similar_history_diff()
             {
                 return most_similar_history.diff;
@@ -297,7 +343,13 @@ namespace MatHistPredict {
                 }
             }
 
-            /* Dump IDs and similarities of gauss points with most similar histories to file. For later use with the graph reduction python script. */
+            /* List of the histories within threshold difference of this history */
+            std::vector<HISTORY_ID_DIFF_PAIR> * get_most_similar_histories()
+            {
+                return &most_similar_histories;
+            }
+
+            /* Dump IDs and similarities of gauss points with most similar histories to file. For offline analysis with the graph reduction python script. */
             void most_similar_histories_to_file(const char *out_fname)
             {
                 std::ofstream outfile(out_fname);
@@ -313,7 +365,8 @@ namespace MatHistPredict {
                 outfile.close();
             }
 
-            /* For theory-checking/development only. This method will be eventually removed. */
+            /* For theory-checking/development only. This method will be eventually removed. Only the pairs within
+             * threshold difference are listed, the other ones being neither fully compared nor always compared. */
             void all_similar_histories_to_file(const char *out_fname)
             {
                 std::ofstream outfile(out_fname);
@@ -338,35 +391,6 @@ namespace MatHistPredict {
                 return false;
             }
 
-            /* Read mapping.csv file output from the coarsegrain_dependency_network.py script */
-            void read_coarsegrain_dependency_mapping(const char *in_fname)
-            {
-                std::ifstream infile(in_fname);
-                if(infile.fail()) {
-                    fprintf(stderr, "Could not open %s for reading.\n", in_fname);
-                    exit(1);
-                }
-                uint32_t id_from, id_to;
-
-                // Skip lines until line that contains this ID
-                // Line number doesn't not always fit cell ID because
-                // if cell has no similar history it is not captured by the python script
-                std::string line;
-                for(uint32_t i = 0; i < ID; i++) {
-                    std::getline(infile, line);
-                }
-                infile >> id_from >> id_to;
-
-                if(id_from != ID) {
-                    fprintf(stderr, "ID in mapping file (%u) does not match cell ID (%u)\n", id_from, ID);
-                    exit(1);
-                }
-
-                this->ID_to_get_results_from = id_to;
-
-                infile.close();
-            }
-
             /* What guass point (defined by its ID) should this gauss point be expecting its next
              * MD results from.
              */
@@ -397,13 +421,145 @@ namespace MatHistPredict {
 
         private:
 
+            /* Strain history of component c (in the order XX, YY, ZZ, XY, XZ, YZ) */
+            std::vector<double>& in_component(uint32_t c)
+            {
+                switch(c) {
+                    case 0: return in_XX;
+                    case 1: return in_YY;
+                    case 2: return in_ZZ;
+                    case 3: return in_XY;
+                    case 4: return in_XZ;
+                    default: return in_YZ;
+                }
+            }
+
+            /* Add a strain state to the history, and carry on the forward elimination of the spline system
+             * z_i-1 + 4 z_i + z_i+1 = y_i+1 - 2 y_i + y_i-1 (z_0 = z_n-1 = 0, natural spline) with the row of the
+             * knot that was the last one until now. For a bounded history, only the steps falling on the current
+             * stride are stored, and the stored states are decimated when the bound is reached.
+             */
+            void append_strain(double strain_xx, double strain_yy, double strain_zz, double strain_xy, double strain_xz, double strain_yz)
+            {
+                uint32_t step = num_steps_added;
+                num_steps_added++;
+
+                // Most recent strain state (the last knot of the spline if it is not stored)
+                tail_strain[0] = strain_xx;
+                tail_strain[1] = strain_yy;
+                tail_strain[2] = strain_zz;
+                tail_strain[3] = strain_xy;
+                tail_strain[4] = strain_xz;
+                tail_strain[5] = strain_yz;
+                up_to_date = false;
+
+                if(step % knot_stride != 0) return;
+                if(max_num_knots != 0 && num_knots == max_num_knots) {
+                    decimate_knots();
+                    if(step % knot_stride != 0) return;
+                }
+
+                in_XX.push_back(strain_xx);
+                in_YY.push_back(strain_yy);
+                in_ZZ.push_back(strain_zz);
+                in_XY.push_back(strain_xy);
+                in_XZ.push_back(strain_xz);
+                in_YZ.push_back(strain_yz);
+                num_knots++;
+
+                forward_eliminate(num_knots);
+            }
+
+            /* Forward elimination of the row of knot n-2, once the first n knots are stored (see append_strain()) */
+            void forward_eliminate(uint32_t n)
+            {
+                if(n == 2) {
+                    elim_c.push_back(0);
+                    for(uint32_t c = 0; c < 6; c++) elim_d[c].push_back(0);
+                } else if(n > 2) {
+                    uint32_t i = n - 2;
+                    double denom = 4.0 - elim_c[i - 1];
+                    elim_c.push_back(1.0/denom);
+                    for(uint32_t c = 0; c < 6; c++) {
+                        std::vector<double>& y = in_component(c);
+                        double rhs = y[i + 1] - 2.0*y[i] + y[i - 1];
+                        elim_d[c].push_back((rhs - elim_d[c][i - 1])/denom);
+                    }
+                }
+            }
+
+            /* Keep every other stored strain state (the first one included) and double the stride between stored
+             * steps, then redo the forward elimination over the remaining knots (which happens once every
+             * max_num_knots/2 stored steps, i.e. at a constant amortized cost per step).
+             */
+            void decimate_knots()
+            {
+                uint32_t num_kept = (num_knots + 1)/2;
+                for(uint32_t c = 0; c < 6; c++) {
+                    std::vector<double>& y = in_component(c);
+                    for(uint32_t i = 0; i < num_kept; i++) y[i] = y[2*i];
+                    y.resize(num_kept);
+                }
+                num_knots = num_kept;
+                knot_stride *= 2;
+
+                elim_c.clear();
+                for(uint32_t c = 0; c < 6; c++) elim_d[c].clear();
+                for(uint32_t n = 2; n <= num_knots; n++) forward_eliminate(n);
+            }
+
+            /* Position in [0,1] of knot i of the spline, out of n knots (the last one being the most recent step) */
+            double knot_position(uint32_t i, uint32_t n)
+            {
+                if(i == n - 1) return 1.0;
+                return (double)(i*knot_stride)/(double)(num_steps_added - 1);
+            }
+
+            /* Solution z_k of the spline system of component c (second derivative at knot k is 6 z_k/dx^2),
+             * back substituted from at most backsubst_window knots further, z_last being the solution at
+             * the last stored knot.
+             */
+            double second_derivative_factor(uint32_t c, uint32_t k, double z_last)
+            {
+                uint32_t last = num_knots - 1;
+                if(k == 0) return 0;
+                if(k >= last) return z_last;
+
+                // Beyond the window, the solution is truncated to zero
+                uint32_t j = std::min(last, k + backsubst_window + 1);
+                double z = (j == last) ? z_last : 0;
+                while(j > k) {
+                    j--;
+                    z = elim_d[c][j] - elim_c[j]*z;
+                }
+                return z;
+            }
+
+            // Number of knots over which the back substitution of the spline system is carried out
+            static const uint32_t backsubst_window = 32;
+
+            // Forward elimination coefficients of the spline system (one per knot, except the last), the
+            // matrix ones being the same for all components
+            std::vector<double> elim_c;
+            std::vector<double> elim_d[6];
+
             // True if the spline has been recalculated for the current history
             bool up_to_date;
 
             // How many strain states have been added to this history
             uint32_t num_steps_added;
 
-            // Input strain history at each timestep (used to build spline).
+            // How many strain states are stored in this history, the stored state i being the step i*knot_stride
+            uint32_t num_knots;
+            uint32_t knot_stride;
+
+            // Maximum number of stored strain states (0 if unbounded)
+            uint32_t max_num_knots;
+
+            // Most recent strain state
+            double tail_strain[6];
+
+            // Input strain history at each stored timestep (used to build spline).
             // Represents the 6 unique components of the strain tensor.
             std::vector<double> in_XX, in_YY, in_ZZ, in_XY, in_XZ, in_YZ;
 
@@ -422,16 +578,18 @@ namespace MatHistPredict {
             // Contains the most recently built spline
             std::vector<double> spline;
 
-            // The ID and L2 norm difference of the most similar strain history, calculated by running compare_histories_with_all_ranks()
+            // The ID and L2 norm difference of the most similar strain history within threshold difference, calculated by
+            // running compare_histories_with_all_ranks()
             HISTORY_ID_DIFF_PAIR most_similar_history;
 
             // List of all (other) histories within threshold difference of this history
             std::vector<HISTORY_ID_DIFF_PAIR> most_similar_histories;
 
-            // Contains full list of comparisons - required for theory-checking only, and will be removed
+            // Contains the list of comparisons within threshold difference (the other pairs are pruned by the HistoryIndex
+            // or their comparison is stopped early) - required for theory-checking only, and will be removed
             std::vector<HISTORY_ID_DIFF_PAIR> all_similar_histories;
 
-            // After the graph reduction python script has run, this should be the ID of the gauss point whose
+            // After the graph reduction has run, this should be the ID of the gauss point whose
             // MD simulation results (stress) should be used for updating this cell.
             uint32_t ID_to_get_results_from;
 
@@ -440,27 +598,53 @@ namespace MatHistPredict {
     };
 
     /**
-     * Data type for serializing Strain6D objects to for sending/receiving via MPI
+     * Contiguous block holding the IDs and splines of all the Strain6D objects of a rank, for sending/receiving
+     * them via MPI in a single message. Layout is: number of histories, number of spline points per history,
+     * then for each history its ID followed by its spline (IDs are stored as doubles, which is exact for uint32_t).
      */
-    class Strain6DReceiver
+    class Strain6DBlock
     {
         public:
-            Strain6DReceiver(int32_t max_buf_size)
+            /* Pack the IDs and splines of the given histories in the buffer */
+            void pack(std::vector<Strain6D*>& histories)
             {
-                this->max_buf_size = max_buf_size;
-                spline = new double[max_buf_size];
+                uint32_t num_points = (histories.size() > 0) ? histories[0]->get_spline()->size() : 0;
+
+                buffer.resize(2 + histories.size() * (num_points + 1));
+                buffer[0] = histories.size();
+                buffer[1] = num_points;
+                for(uint32_t h = 0; h < histories.size(); h++) {
+                    std::vector<double> *spline = histories[h]->get_spline();
+                    if(spline->size() != num_points) {
+                        fprintf(stderr, "Error in Strain6DBlock::pack(): histories have different numbers of spline points (%u and %u)\n", (uint32_t)spline->size(), num_points);
+                        exit(1);
+                    }
+                    buffer[2 + h * (num_points + 1)] = histories[h]->get_ID();
+                    std::copy(spline->begin(), spline->end(), buffer.begin() + 2 + h * (num_points + 1) + 1);
+                }
             }
 
-            ~Strain6DReceiver()
+            uint32_t get_num_histories()
             {
-                delete[] spline;
-                this->max_buf_size = 0;
+                return (uint32_t)buffer[0];
             }
 
-            int32_t max_buf_size; // Max number of doubles that can be received from another rank
-            double *spline;
-            uint32_t ID;
-            uint32_t recv_count;
+            uint32_t get_num_points()
+            {
+                return (uint32_t)buffer[1];
+            }
+
+            uint32_t get_ID(uint32_t h)
+            {
+                return (uint32_t)buffer[2 + h * (get_num_points() + 1)];
+            }
+
+            double * get_spline(uint32_t h)
+            {
+                return &buffer[2 + h * (get_num_points() + 1) + 1];
+            }
+
+            std::vector<double> buffer;
     };
 
     /**
@@ -483,6 +667,40 @@ namespace MatHistPredict {
         return sqrt(sum);
     }
 
+    /**
+     * Calculate the L2 norm difference of two arrays (a and b) of num_points values, stopping as soon as it is
+     * known to exceed max_diff (in which case the partial difference, already larger than max_diff, is returned).
+     * Squared differences are computed over blocks of independent values, which the compiler vectorises, and summed
+     * in the same order as in compare_L2_norm() so that both return the exact same value.
+     */
+    double compare_L2_norm_bounded(const double *a, const double *b, uint32_t num_points, double max_diff)
+    {
+        const uint32_t block_size = 12;
+        double max_sum = max_diff*max_diff;
+        double sum = 0;
+
+        uint32_t i = 0;
+        for(; i + block_size <= num_points; i += block_size) {
+            double sq_diff[block_size];
+            for(uint32_t k = 0; k < block_size; k++) {
+                double diff = a[i + k] - b[i + k];
+                sq_diff[k] = diff*diff;
+            }
+            for(uint32_t k = 0; k < block_size; k++) {
+                sum += sq_diff[k];
+            }
+            if(sum > max_sum) {
+                return sqrt(sum);
+            }
+        }
+        for(; i < num_points; i++) {
+            double diff = a[i] - b[i];
+            sum += diff*diff;
+        }
+
+        return sqrt(sum);
+    }
+
     /**
      * Calculate the L2 norm difference of two arrays (a and b)
      */
@@ -496,52 +714,198 @@ namespace MatHistPredict {
     }
 
     /**
-     * Calculate the L2 norm difference of two Strain6D objects
+     * Calculate the L2 norm difference of a Strain6D object and a spline array (b)
      */
-    double compare_L2_norm(Strain6D *a, Strain6DReceiver *b)
+    double compare_L2_norm(Strain6D *a, double *b, uint32_t num_points_b)
     {
         double *hist_A = a->get_spline()->data();
-        double *hist_B = b->spline;
         uint32_t num_points_A = a->get_spline()->size();
-        uint32_t num_points_B = b->recv_count;
-        return compare_L2_norm(hist_A, hist_B, num_points_A, num_points_B);
+        return compare_L2_norm(hist_A, b, num_points_A, num_points_b);
+    }
+
+    /* Allow taking the modulo of negative numbers too */
+    int32_t modulo_neg(int32_t x, int32_t n)
+    {
+        return ((x%n + n) % n);
     }
 
     /**
-     *  Sends the given strain6D object to the target_rank
+     * Posts the non-blocking exchange of ring step i: the local block is sent to this_rank+i (periodic) and the block
+     * of this_rank-i (periodic) is received in recv_block, which is sized from the gathered sizes of all blocks.
      */
-    void send_strain6D_mpi(Strain6D *in_s6D, int32_t target_rank, int32_t this_rank, MPI_Comm comm)
+    void post_ring_step(Strain6DBlock& local_block, Strain6DBlock& recv_block, std::vector<int32_t>& block_sizes, int32_t i,
+            MPI_Request *recv_request, std::vector<MPI_Request>& send_requests, MPI_Comm comm)
     {
-        std::vector<double> *strain = in_s6D->get_spline();
-        uint32_t ID = in_s6D->get_ID();
-        int32_t num_doubles_to_send = strain->size();
+        int32_t this_rank, num_ranks;
+        MPI_Comm_rank(comm, &this_rank);
+        MPI_Comm_size(comm, &num_ranks);
+
+        int32_t target_rank = modulo_neg(this_rank + i, num_ranks); // send data to target_rank
+        int32_t from_rank = modulo_neg(this_rank - i, num_ranks); // receive data sent by from_rank
 
-        MPI_Send(&num_doubles_to_send, 1, MPI_UNSIGNED, target_rank, this_rank, comm);
-        MPI_Send(strain->data(), num_doubles_to_send, MPI_DOUBLE, target_rank, this_rank, comm);
-        MPI_Send(&ID, 1, MPI_UNSIGNED, target_rank, this_rank, comm);
+        recv_block.buffer.resize(block_sizes[from_rank]);
+        MPI_Irecv(recv_block.buffer.data(), block_sizes[from_rank], MPI_DOUBLE, from_rank, i, comm, recv_request);
+
+        MPI_Request send_request;
+        MPI_Isend(local_block.buffer.data(), local_block.buffer.size(), MPI_DOUBLE, target_rank, i, comm, &send_request);
+        send_requests.push_back(send_request);
     }
 
     /**
-     *  Receives a strain6D object (in Strain6DReceiver form) from the target_rank
+     * Pivot-based metric index over the splines of a set of Strain6D objects, used to find the histories
+     * that may lie within a given L2 distance of a query without comparing it with every history. Since
+     * |d(q,p) - d(h,p)| <= d(q,h) for any pivot p (triangle inequality), only the histories whose distances
+     * to all pivots are within threshold of those of the query can be similar to it. Histories are sorted by
+     * their distance to the first pivot, so that this candidate range is found by binary search.
      */
-    void receive_strain6D_mpi(Strain6DReceiver *recv, int32_t from_rank, MPI_Comm comm)
+    class HistoryIndex
     {
-        MPI_Status status;
-        MPI_Recv(&(recv->recv_count), 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
-        MPI_Recv(recv->spline, recv->max_buf_size, MPI_DOUBLE, from_rank, from_rank, comm, &status);
-        MPI_Recv(&(recv->ID), 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
-    }
+        public:
+            /* Build the index of the given histories, using num_pivots pivots picked as far apart as possible */
+            HistoryIndex(std::vector<Strain6D*>& histories, uint32_t num_pivots)
+            {
+                num_histories = histories.size();
+                num_points = (num_histories > 0) ? histories[0]->get_spline()->size() : 0;
+                this->num_pivots = std::min(num_pivots, num_histories);
+
+                // Greedy farthest-point choice of the pivots, starting from the first history
+                std::vector<double> dist_to_pivots(num_histories, std::numeric_limits<double>::infinity());
+                pivot_distances.resize(this->num_pivots * num_histories);
+                uint32_t next_pivot = 0;
+                for(uint32_t k = 0; k < this->num_pivots; k++) {
+                    pivots.push_back(*(histories[next_pivot]->get_spline()));
+                    for(uint32_t h = 0; h < num_histories; h++) {
+                        double d = compare_L2_norm(histories[h]->get_spline()->data(), pivots[k].data(), histories[h]->get_spline()->size(), num_points);
+                        pivot_distances[h * this->num_pivots + k] = d;
+                        dist_to_pivots[h] = std::min(dist_to_pivots[h], d);
+                    }
+                    next_pivot = std::max_element(dist_to_pivots.begin(), dist_to_pivots.end()) - dist_to_pivots.begin();
+                }
 
-    /* Allow taking the modulo of negative numbers too */
-    int32_t modulo_neg(int32_t x, int32_t n)
-    {
-        return ((x%n + n) % n);
-    }
+                // Order histories by increasing distance to the first pivot
+                order.resize(num_histories);
+                for(uint32_t h = 0; h < num_histories; h++) {
+                    order[h] = h;
+                }
+                if(this->num_pivots > 0) {
+                    std::vector<double>& pd = pivot_distances;
+                    uint32_t np = this->num_pivots;
+                    std::sort(order.begin(), order.end(), [&pd, np](uint32_t a, uint32_t b) { return pd[a * np] < pd[b * np]; });
+                }
+                first_pivot_distances.resize(num_histories);
+                for(uint32_t i = 0; i < num_histories; i++) {
+                    first_pivot_distances[i] = (this->num_pivots > 0) ? pivot_distances[order[i] * this->num_pivots] : 0;
+                }
+
+                // Copy of the splines in one contiguous matrix (one row per history, in the same order as
+                // order), so that candidates close to each other in the index are close in memory too
+                splines.resize(num_histories * num_points);
+                row_of_history.resize(num_histories);
+                for(uint32_t i = 0; i < num_histories; i++) {
+                    std::vector<double> *spline = histories[order[i]]->get_spline();
+                    if(spline->size() != num_points) {
+                        fprintf(stderr, "Error in HistoryIndex: given strain6D objects have different numbers of spline points (%u and %u)\n", (uint32_t)spline->size(), num_points);
+                        exit(1);
+                    }
+                    std::copy(spline->begin(), spline->end(), splines.begin() + i * num_points);
+                    row_of_history[order[i]] = i;
+                }
+            }
+
+            /* Spline of history h (index in the indexed vector) */
+            const double * get_spline(uint32_t h)
+            {
+                return &splines[row_of_history[h] * num_points];
+            }
+
+            uint32_t get_num_points()
+            {
+                return num_points;
+            }
+
+            /* Fill candidates with the indices (in the indexed vector) of the histories that may be within
+             * threshold of the query spline.
+             */
+            void find_candidates(double *query, uint32_t num_points_query, double threshold, std::vector<uint32_t>& candidates)
+            {
+                candidates.clear();
+                if(num_histories == 0) return;
+                if(num_pivots == 0) {
+                    candidates = order;
+                    return;
+                }
+
+                std::vector<double> query_distances(num_pivots);
+                for(uint32_t k = 0; k < num_pivots; k++) {
+                    query_distances[k] = compare_L2_norm(query, pivots[k].data(), num_points_query, num_points);
+                }
+
+                double slack = 1e-12 * (query_distances[0] + threshold);
+                std::vector<double>::iterator lo = std::lower_bound(first_pivot_distances.begin(), first_pivot_distances.end(), query_distances[0] - threshold - slack);
+                std::vector<double>::iterator hi = std::upper_bound(first_pivot_distances.begin(), first_pivot_distances.end(), query_distances[0] + threshold + slack);
+                for(uint32_t i = lo - first_pivot_distances.begin(); i < (uint32_t)(hi - first_pivot_distances.begin()); i++) {
+                    if(within_pivot_bounds(order[i], query_distances.data(), threshold)) {
+                        candidates.push_back(order[i]);
+                    }
+                }
+            }
+
+            /* Fill pairs with the (a, b) indices (in the indexed vector) of the pairs of histories that may be
+             * within threshold of each other. Every pair is only listed once.
+             */
+            void find_candidate_pairs(double threshold, std::vector<std::pair<uint32_t,uint32_t> >& pairs)
+            {
+                pairs.clear();
+                for(uint32_t i = 0; i < num_histories; i++) {
+                    uint32_t a = order[i];
+                    double slack = 1e-12 * (first_pivot_distances[i] + threshold);
+                    for(uint32_t j = i + 1; j < num_histories; j++) {
+                        if(num_pivots > 0 && first_pivot_distances[j] - first_pivot_distances[i] > threshold + slack) break;
+                        uint32_t b = order[j];
+                        if(num_pivots == 0 || within_pivot_bounds(b, &pivot_distances[a * num_pivots], threshold)) {
+                            pairs.push_back(std::make_pair(a, b));
+                        }
+                    }
+                }
+            }
+
+        private:
+            /* True if the distances of history h to the pivots do not rule out it being within threshold of
+             * an object with the given distances to the pivots.
+             */
+            bool within_pivot_bounds(uint32_t h, double *distances, double threshold)
+            {
+                for(uint32_t k = 0; k < num_pivots; k++) {
+                    double d = pivot_distances[h * num_pivots + k];
+                    if(fabs(d - distances[k]) > threshold + 1e-12 * (d + distances[k])) return false;
+                }
+                return true;
+            }
+
+            uint32_t num_histories;
+            uint32_t num_points;
+            uint32_t num_pivots;
+
+            // Splines of the pivot histories
+            std::vector<std::vector<double> > pivots;
+
+            // Distance of each history to each pivot (num_pivots values per history)
+            std::vector<double> pivot_distances;
+
+            // Histories sorted by increasing distance to the first pivot, and these distances
+            std::vector<uint32_t> order;
+            std::vector<double> first_pivot_distances;
+
+            // Splines of the histories (num_points values per history), and row of each history in it
+            std::vector<double> splines;
+            std::vector<uint32_t> row_of_history;
+    };
 
     /**
      * Compares all strain histories across all ranks in given MPI communicator. Proceeds in a ring-like fashion,
      * with every rank sending to RANKID + 1 and receiving from RANKID - 1, then sending/receiving to/from RANKID +/- 2
-     * and so on until all ranks have compared all histories.
+     * and so on until all ranks have compared all histories. Only the pairs of histories that are not ruled out by
+     * the HistoryIndex of the histories on this rank are actually compared.
      */
     void compare_histories_with_all_ranks(std::vector<Strain6D*>& histories, double threshold, MPI_Comm comm)
     {
@@ -551,10 +915,6 @@ namespace MatHistPredict {
         MPI_Comm_rank(comm, &this_rank);
         MPI_Comm_size(comm, &num_ranks);
 
-        // For receiving the strain history and ID from another rank
-        const int32_t max_buf_size = 2000;
-        Strain6DReceiver recv(max_buf_size);
-
         // num strain6D histories on this rank
         uint32_t num_histories_on_this_rank = histories.size();
 
@@ -564,53 +924,235 @@ namespace MatHistPredict {
             histories[h]->clear_most_similar_history();
         }
 
+        // Index of the histories on this rank, queried with the histories of every rank
+        HistoryIndex index(histories, 4);
+        std::vector<uint32_t> candidates;
+
+        // All histories of this rank are sent in one block, and the size of the blocks of
+        // all ranks is known beforehand, so that receive buffers fit the actual splines
+        Strain6DBlock local_block;
+        local_block.pack(histories);
+        int32_t local_block_size = local_block.buffer.size();
+        std::vector<int32_t> block_sizes(num_ranks);
+        MPI_Allgather(&local_block_size, 1, MPI_INT, block_sizes.data(), 1, MPI_INT, comm);
+
         // Cycle through all ranks in the communicator in a ring-like fashion, sending
         // to this_rank+i (periodic) and receiving from this_rank-i (periodic). This
         // ensures that every rank gets the data from every other rank (for comparison)
-        // wihout ever needing to hold all cells in memory at once.
-        for(int32_t i = 0; i < num_ranks; i++) {
-            int32_t target_rank = modulo_neg(this_rank + i, num_ranks); // send data to target_rank
-            int32_t from_rank = modulo_neg(this_rank - i, num_ranks); // receive data sent by from_rank
+        // wihout ever needing to hold all cells in memory at once. Two receive blocks
+        // are used in turn, so that the transfer of the block of step i+1 overlaps with
+        // the comparison of the block of step i.
+        Strain6DBlock recv_blocks[2];
+        MPI_Request recv_requests[2];
+        std::vector<MPI_Request> send_requests;
+
+        if(num_ranks > 1) {
+            post_ring_step(local_block, recv_blocks[1], block_sizes, 1, &recv_requests[1], send_requests, comm);
+        }
 
-            // If we are not considering cells on the same rank
-            if(target_rank != this_rank) {
-                // Indicate the number of histories that will be sent to target_rank
-                MPI_Send(&num_histories_on_this_rank, 1, MPI_UNSIGNED, target_rank, this_rank, comm);
+        // Considering cells on the same rank
+        std::vector<std::pair<uint32_t,uint32_t> > pairs;
+        index.find_candidate_pairs(threshold, pairs);
+        for(uint32_t p = 0; p < pairs.size(); p++) {
+            uint32_t a = pairs[p].first;
+            uint32_t b = pairs[p].second;
+            double diff = compare_L2_norm_bounded(index.get_spline(a), index.get_spline(b), index.get_num_points(), threshold);
+
+            // Both Strain6D's need this info (only exact differences, below the threshold, are recorded)
+            if(diff < threshold) {
+                histories[a]->choose_most_similar_history(diff, histories[b]->get_ID(), threshold);
+                histories[b]->choose_most_similar_history(diff, histories[a]->get_ID(), threshold);
+            }
+        }
 
-                // Send all histories and IDs
-                for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
-                    send_strain6D_mpi(histories[h], target_rank, this_rank, comm);
+        // Considering cells on the other ranks
+        for(int32_t i = 1; i < num_ranks; i++) {
+            Strain6DBlock& recv = recv_blocks[i % 2];
+            MPI_Wait(&recv_requests[i % 2], &status);
+
+            if(i + 1 < num_ranks) {
+                post_ring_step(local_block, recv_blocks[(i + 1) % 2], block_sizes, i + 1, &recv_requests[(i + 1) % 2], send_requests, comm);
+            }
+
+            // Compare histories received from rank this_rank-i with all histories on this rank
+            for(uint32_t r = 0; r < recv.get_num_histories(); r++) {
+                if(recv.get_num_points() != index.get_num_points() && num_histories_on_this_rank > 0) {
+                    fprintf(stderr, "Error in compare_histories_with_all_ranks(): given strain6D objects have different numbers of spline points (%u and %u)\n", index.get_num_points(), recv.get_num_points());
+                    exit(1);
+                }
+                index.find_candidates(recv.get_spline(r), recv.get_num_points(), threshold, candidates);
+                for(uint32_t c = 0; c < candidates.size(); c++) {
+                    uint32_t h = candidates[c];
+                    double diff = compare_L2_norm_bounded(index.get_spline(h), recv.get_spline(r), index.get_num_points(), threshold);
+                    if(diff < threshold) {
+                        histories[h]->choose_most_similar_history(diff, recv.get_ID(r), threshold);
+                    }
                 }
+            }
+        }
+
+        MPI_Waitall(send_requests.size(), send_requests.data(), MPI_STATUSES_IGNORE);
+    }
 
-                // Get number of histories to receive from from_rank
-                uint32_t num_histories_to_receive = 0;
-                MPI_Recv(&num_histories_to_receive, 1, MPI_UNSIGNED, from_rank, from_rank, comm, &status);
+    /**
+     * Reduces the dependency graph given as a list of edges (pairs of history IDs). The node with the
+     * highest degree (lowest ID first in case of a tie) is removed along with all its neighbours,
+     * which are mapped to get their results from that node, until no node remains. Histories that are
+     * not part of the graph get their results from themselves. Returns the number of iterations.
+     */
+    uint32_t reduce_dependency_graph(std::vector<uint32_t>& IDs, std::vector<uint32_t>& edges, std::vector<uint32_t>& mapping)
+    {
+        // Nodes of the graph, and undirected edges between them (without duplicates)
+        std::vector<uint32_t> nodes(edges);
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        uint32_t num_nodes = nodes.size();
+
+        std::vector<std::pair<uint32_t,uint32_t> > links;
+        for(uint32_t e = 0; e + 1 < edges.size(); e += 2) {
+            uint32_t a = std::lower_bound(nodes.begin(), nodes.end(), edges[e]) - nodes.begin();
+            uint32_t b = std::lower_bound(nodes.begin(), nodes.end(), edges[e + 1]) - nodes.begin();
+            if(a == b) continue;
+            links.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+        }
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+
+        // Adjacency of the nodes in compressed sparse row format
+        std::vector<uint32_t> offsets(num_nodes + 1, 0);
+        for(uint32_t l = 0; l < links.size(); l++) {
+            offsets[links[l].first + 1]++;
+            offsets[links[l].second + 1]++;
+        }
+        for(uint32_t n = 0; n < num_nodes; n++) {
+            offsets[n + 1] += offsets[n];
+        }
+        std::vector<uint32_t> neighbours(offsets[num_nodes]);
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for(uint32_t l = 0; l < links.size(); l++) {
+            neighbours[fill[links[l].first]++] = links[l].second;
+            neighbours[fill[links[l].second]++] = links[l].first;
+        }
 
-                // Receive histories from rank from_rank, and compare with all histories on this rank
-                for(uint32_t r = 0; r < num_histories_to_receive; r++) {
+        // Nodes ordered by decreasing degree, then by increasing ID
+        std::vector<int32_t> degree(num_nodes);
+        std::set<std::pair<int32_t,uint32_t> > queue;
+        for(uint32_t n = 0; n < num_nodes; n++) {
+            degree[n] = offsets[n + 1] - offsets[n];
+            queue.insert(std::make_pair(-degree[n], n));
+        }
 
-                    receive_strain6D_mpi(&recv, from_rank, comm);
+        std::vector<bool> removed(num_nodes, false);
+        std::vector<uint32_t> node_mapping(num_nodes);
+        uint32_t iterations = 0;
+        while(!queue.empty()) {
+            uint32_t max_deg_node = queue.begin()->second;
+
+            // Map this node and all its remaining neighbours to the max degree node
+            std::vector<uint32_t> culled(1, max_deg_node);
+            for(uint32_t k = offsets[max_deg_node]; k < offsets[max_deg_node + 1]; k++) {
+                if(!removed[neighbours[k]]) {
+                    culled.push_back(neighbours[k]);
+                }
+            }
+            for(uint32_t c = 0; c < culled.size(); c++) {
+                node_mapping[culled[c]] = nodes[max_deg_node];
+                removed[culled[c]] = true;
+                queue.erase(std::make_pair(-degree[culled[c]], culled[c]));
+            }
 
-                    for(uint32_t h = 0; h < num_histories_on_this_rank; h++) {
-                        double diff = compare_L2_norm(histories[h], &recv);
-                        histories[h]->choose_most_similar_history(diff, recv.ID, threshold);
-                    }
+            // Update the degree of the nodes remaining in the graph
+            for(uint32_t c = 0; c < culled.size(); c++) {
+                for(uint32_t k = offsets[culled[c]]; k < offsets[culled[c] + 1]; k++) {
+                    uint32_t n = neighbours[k];
+                    if(removed[n]) continue;
+                    queue.erase(std::make_pair(-degree[n], n));
+                    degree[n]--;
+                    queue.insert(std::make_pair(-degree[n], n));
                 }
+            }
 
+            iterations++;
+        }
 
-            } else { // Considering cells on the same rank
+        mapping.resize(IDs.size());
+        for(uint32_t i = 0; i < IDs.size(); i++) {
+            std::vector<uint32_t>::iterator it = std::lower_bound(nodes.begin(), nodes.end(), IDs[i]);
+            if(it != nodes.end() && *it == IDs[i]) {
+                mapping[i] = node_mapping[it - nodes.begin()];
+            } else {
+                mapping[i] = IDs[i];
+            }
+        }
 
-                for(uint32_t a = 0; a < num_histories_on_this_rank; a++) {
-                    for(uint32_t b = a + 1; b < num_histories_on_this_rank; b++) {
-                        double diff = compare_L2_norm(histories[a], histories[b]);
+        return iterations;
+    }
 
-                        // Both Strain6D's need this info
-                        histories[a]->choose_most_similar_history(diff, histories[b]->get_ID(), threshold);
-                        histories[b]->choose_most_similar_history(diff, histories[a]->get_ID(), threshold);
-                    }
-                }
+    /**
+     * Coarse-grains the similarity graph of the histories of all ranks in the given MPI communicator.
+     * The edge lists (from the most similar histories of every Strain6D) are gathered on the first rank,
+     * where the graph is reduced, then the resulting mapping is scattered back to the ranks and stored in
+     * each Strain6D as the ID of the gauss point to get its results from.
+     */
+    void coarsegrain_dependency_network(std::vector<Strain6D*>& histories, MPI_Comm comm)
+    {
+        int32_t this_rank, num_ranks;
+        MPI_Comm_rank(comm, &this_rank);
+        MPI_Comm_size(comm, &num_ranks);
+
+        // IDs and similarity edges of the histories on this rank
+        int32_t num_histories_on_this_rank = histories.size();
+        std::vector<uint32_t> local_IDs(num_histories_on_this_rank);
+        std::vector<uint32_t> local_edges;
+        for(int32_t h = 0; h < num_histories_on_this_rank; h++) {
+            local_IDs[h] = histories[h]->get_ID();
+            std::vector<HISTORY_ID_DIFF_PAIR> *similar = histories[h]->get_most_similar_histories();
+            for(uint32_t s = 0; s < similar->size(); s++) {
+                local_edges.push_back(local_IDs[h]);
+                local_edges.push_back((*similar)[s].ID);
             }
         }
+        int32_t num_local_edges = local_edges.size();
+
+        std::vector<int32_t> num_IDs(num_ranks), num_edges(num_ranks);
+        MPI_Gather(&num_histories_on_this_rank, 1, MPI_INT, num_IDs.data(), 1, MPI_INT, 0, comm);
+        MPI_Gather(&num_local_edges, 1, MPI_INT, num_edges.data(), 1, MPI_INT, 0, comm);
+
+        std::vector<int32_t> displs_IDs(num_ranks, 0), displs_edges(num_ranks, 0);
+        for(int32_t r = 1; r < num_ranks; r++) {
+            displs_IDs[r] = displs_IDs[r - 1] + num_IDs[r - 1];
+            displs_edges[r] = displs_edges[r - 1] + num_edges[r - 1];
+        }
+
+        std::vector<uint32_t> all_IDs, all_edges, all_mapping;
+        if(this_rank == 0) {
+            all_IDs.resize(displs_IDs[num_ranks - 1] + num_IDs[num_ranks - 1]);
+            all_edges.resize(displs_edges[num_ranks - 1] + num_edges[num_ranks - 1]);
+        }
+        MPI_Gatherv(local_IDs.data(), num_histories_on_this_rank, MPI_UNSIGNED,
+                all_IDs.data(), num_IDs.data(), displs_IDs.data(), MPI_UNSIGNED, 0, comm);
+        MPI_Gatherv(local_edges.data(), num_local_edges, MPI_UNSIGNED,
+                all_edges.data(), num_edges.data(), displs_edges.data(), MPI_UNSIGNED, 0, comm);
+
+        if(this_rank == 0) {
+            uint32_t iterations = reduce_dependency_graph(all_IDs, all_edges, all_mapping);
+
+            uint32_t num_simulations = 0;
+            for(uint32_t i = 0; i < all_IDs.size(); i++) {
+                if(all_mapping[i] == all_IDs[i]) num_simulations++;
+            }
+            std::cout << "              Converged in " << iterations << " iterations" << std::endl;
+            std::cout << "              Number of gauss points to be udpated: " << all_IDs.size() << std::endl;
+            std::cout << "              Number of simulations required: " << num_simulations << std::endl;
+        }
+
+        std::vector<uint32_t> local_mapping(num_histories_on_this_rank);
+        MPI_Scatterv(all_mapping.data(), num_IDs.data(), displs_IDs.data(), MPI_UNSIGNED,
+                local_mapping.data(), num_histories_on_this_rank, MPI_UNSIGNED, 0, comm);
+
+        for(int32_t h = 0; h < num_histories_on_this_rank; h++) {
+            histories[h]->set_ID_to_get_results_from(local_mapping[h]);
+        }
     }
 }
 #endif /* MATHISTPREDICT_STRAIN2SPLINE_H */
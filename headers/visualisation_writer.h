@@ -0,0 +1,141 @@
+#ifndef VISUALISATION_WRITER_H
+#define VISUALISATION_WRITER_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <stdint.h>
+#include <iostream>
+
+#include <mpi.h>
+
+#include <deal.II/base/thread_management.h>
+#include <deal.II/base/multithread_info.h>
+#include <deal.II/numerics/data_out.h>
+
+namespace HMM
+{
+	using namespace dealii;
+
+	// DataOut giving access to the parts of the VTU file, the piece holding the patches of
+	// this process being formatted independently of the header and footer of the file. The
+	// flags of DataOutInterface being private, the parts are formatted with flags of its own.
+	template <int dim>
+	class VisualisationDataOut : public DataOut<dim>
+	{
+	public:
+		std::string vtu_header () const
+		{
+			std::ostringstream header;
+			DataOutBase::write_vtu_header (header, vtu_flags);
+			return header.str();
+		}
+
+		std::string vtu_piece () const
+		{
+			std::ostringstream piece;
+			DataOutBase::write_vtu_main (this->get_patches(), this->get_dataset_names(),
+					this->get_vector_data_ranges(), vtu_flags, piece);
+			return piece.str();
+		}
+
+		std::string vtu_footer () const
+		{
+			std::ostringstream footer;
+			DataOutBase::write_vtu_footer (footer);
+			return footer.str();
+		}
+
+		DataOutBase::VtkFlags	vtu_flags;
+	};
+
+	// Writer of a single VTU file per output for all the processes. The pieces of the processes
+	// are written collectively with MPI-IO, in the order of the processes. When more than one
+	// thread is available, the DataOut (whose patches have been built) is kept as a snapshot while
+	// its local piece is formatted by a background task, and the file is written when the next
+	// outputs are issued or when the writer is flushed. With a single thread, a task would only run
+	// when waited for, so the piece is formatted and the file written right away instead.
+	template <int dim>
+	class AsyncVTUWriter
+	{
+	public:
+		// Collective over the communicator
+		void write (std::shared_ptr<VisualisationDataOut<dim> > data_out, const std::string &filename,
+				MPI_Comm communicator)
+		{
+			// The processes agree on the mode, so that they all write the file at the same time
+			int local_n_threads = MultithreadInfo::n_threads(), n_threads;
+			MPI_Allreduce(&local_n_threads, &n_threads, 1, MPI_INT, MPI_MIN, communicator);
+
+			if (n_threads > 1){
+				PendingOutput output;
+				output.data_out = data_out;
+				output.filename = filename;
+				output.communicator = communicator;
+				output.piece = Threads::new_task (&VisualisationDataOut<dim>::vtu_piece, *data_out);
+				pending_outputs.push_back(output);
+			}
+			else
+				write_in_parallel (*data_out, data_out->vtu_piece(), filename, communicator);
+		}
+
+		// Collective over the communicators of the pending outputs
+		void flush ()
+		{
+			for (unsigned int i=0; i<pending_outputs.size(); ++i)
+				write_in_parallel (*pending_outputs[i].data_out, pending_outputs[i].piece.return_value(),
+						pending_outputs[i].filename, pending_outputs[i].communicator);
+			pending_outputs.clear();
+		}
+
+	private:
+		struct PendingOutput
+		{
+			std::shared_ptr<VisualisationDataOut<dim> >	data_out;
+			std::string					filename;
+			MPI_Comm					communicator;
+			Threads::Task<std::string>			piece;
+		};
+
+		void write_in_parallel (const VisualisationDataOut<dim> &data_out, const std::string &piece,
+				const std::string &output_filename, MPI_Comm communicator)
+		{
+			int this_process;
+			MPI_Comm_rank(communicator, &this_process);
+
+			std::string header;
+			if (this_process == 0) header = data_out.vtu_header();
+
+			// Offset of the piece of this process in the file
+			int64_t header_size = header.size();
+			MPI_Bcast(&header_size, 1, MPI_INT64_T, 0, communicator);
+			int64_t piece_size = piece.size(), piece_offset = 0, pieces_size = 0;
+			MPI_Exscan(&piece_size, &piece_offset, 1, MPI_INT64_T, MPI_SUM, communicator);
+			if (this_process == 0) piece_offset = 0;
+			MPI_Allreduce(&piece_size, &pieces_size, 1, MPI_INT64_T, MPI_SUM, communicator);
+
+			char filename[1024]; sprintf(filename, "%s", output_filename.c_str());
+			MPI_File fh;
+			if (MPI_File_open(communicator, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+					MPI_INFO_NULL, &fh) != MPI_SUCCESS){
+				std::cerr << "Unable to open " << output_filename << " to write visualisation output in it" << std::endl;
+				exit(1);
+			}
+			MPI_File_set_size(fh, 0);
+
+			if (this_process == 0){
+				std::string footer = data_out.vtu_footer();
+				MPI_File_write_at(fh, 0, &header[0], header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+				MPI_File_write_at(fh, header_size + pieces_size, &footer[0], footer.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+			}
+			MPI_File_write_at_all(fh, header_size + piece_offset, piece.data(), piece.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+
+			MPI_File_close(&fh);
+		}
+
+		std::vector<PendingOutput>	pending_outputs;
+	};
+}
+
+#endif
@@ -0,0 +1,72 @@
+import sys
+import struct
+import argparse
+from array import array
+
+# Reader of the quadrature point history store (lhistory.bin and lhistory.bin.index) written
+# by the FE solver: a header, then one chunk per output timestep in which every column is a
+# contiguous array of doubles ordered by quadrature point id.
+# execute as: python read_lhistory.py ./macroscale_log/lhistory.bin --timesteps 10 20 --qpids 0 8 --columns stress_00 stress_11
+
+HEADER_FORMAT = '<iiiiq'
+INDEX_FORMAT = '<qdq'
+MAGIC = 0x53545051
+
+class QPHistory:
+    def __init__(self, filename):
+        self.file = open(filename, 'rb')
+        magic, version, self.n_columns, name_length, self.n_qp = struct.unpack(
+            HEADER_FORMAT, self.file.read(struct.calcsize(HEADER_FORMAT)))
+        if magic != MAGIC or version != 1:
+            sys.exit("Unrecognized format of the quadrature point history file " + filename)
+        self.columns = [self.file.read(name_length).split(b'\0')[0].decode()
+                        for c in range(self.n_columns)]
+
+        # Timestep -> (time, offset), the last chunk written for a timestep superseding the others
+        self.chunks = {}
+        with open(filename + '.index', 'rb') as index_file:
+            entry_size = struct.calcsize(INDEX_FORMAT)
+            entry = index_file.read(entry_size)
+            while len(entry) == entry_size:
+                timestep, time, offset = struct.unpack(INDEX_FORMAT, entry)
+                self.chunks[timestep] = (time, offset)
+                entry = index_file.read(entry_size)
+
+    def timesteps(self):
+        return sorted(self.chunks.keys())
+
+    def time(self, timestep):
+        return self.chunks[timestep][0]
+
+    def column(self, timestep, name, qpids=None):
+        # Values of a column at a given timestep, for all the quadrature points or a list of them
+        offset = self.chunks[timestep][1] + self.columns.index(name)*self.n_qp*8
+        values = array('d')
+        if qpids is None:
+            self.file.seek(offset)
+            values.fromfile(self.file, self.n_qp)
+        else:
+            for qpid in qpids:
+                self.file.seek(offset + qpid*8)
+                values.fromfile(self.file, 1)
+        return values
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Print quadrature point history as CSV')
+    parser.add_argument('filename')
+    parser.add_argument('--timesteps', type=int, nargs='+', help='timesteps (default: all)')
+    parser.add_argument('--qpids', type=int, nargs='+', help='quadrature point ids (default: all)')
+    parser.add_argument('--columns', nargs='+', help='columns (default: all)')
+    args = parser.parse_args()
+
+    history = QPHistory(args.filename)
+    timesteps = args.timesteps if args.timesteps else history.timesteps()
+    columns = args.columns if args.columns else history.columns
+    qpids = args.qpids if args.qpids else range(history.n_qp)
+
+    print(','.join(['timestep', 'time', 'qpid'] + columns))
+    for timestep in timesteps:
+        values = [history.column(timestep, name, args.qpids) for name in columns]
+        for i, qpid in enumerate(qpids):
+            print(','.join([str(timestep), repr(history.time(timestep)), str(qpid)]
+                           + [repr(values[c][i]) for c in range(len(columns))]))
@@ -0,0 +1,68 @@
+import sys
+import glob
+import struct
+import argparse
+from array import array
+
+# Reader of the MD stress sample logs (mddata.batch*.bin and their .index files) written by
+# the MD batches in the nanoscale output directory. The logs of all the batches are merged
+# through their index and printed in CSV, one row per stress sample.
+# execute as: python read_mddata.py ./nanoscale_output --qpids 0 8 --replicas 1
+
+HEADER_FORMAT = '<iiii16s16s16sdd'
+INDEX_FORMAT = '<ii16sq'
+
+def decode(name):
+    return name.split(b'\0')[0].decode()
+
+def read_index(log_filename):
+    entries = []
+    with open(log_filename + '.index', 'rb') as index_file:
+        entry_size = struct.calcsize(INDEX_FORMAT)
+        entry = index_file.read(entry_size)
+        while len(entry) == entry_size:
+            qp_id, replica, time_id, offset = struct.unpack(INDEX_FORMAT, entry)
+            entries.append((qp_id, replica, decode(time_id), offset))
+            entry = index_file.read(entry_size)
+    return entries
+
+def read_record(log_file, offset):
+    log_file.seek(offset)
+    qp_id, replica, n_samples, n_components, matid, time_id, force_field, temperature, strain_rate = \
+        struct.unpack(HEADER_FORMAT, log_file.read(struct.calcsize(HEADER_FORMAT)))
+    strain = array('d')
+    strain.fromfile(log_file, n_components)
+    samples = array('d')
+    samples.fromfile(log_file, n_samples*n_components)
+    header = [str(qp_id), decode(matid), decode(time_id), repr(temperature), repr(strain_rate),
+              decode(force_field), str(replica)]
+    return header, strain, [samples[t*n_components:(t+1)*n_components] for t in range(n_samples)]
+
+def component_names(n_components):
+    dim = 3 if n_components == 6 else 2
+    return [str(k) + str(l) for k in range(dim) for l in range(k, dim)]
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Print MD stress samples as CSV')
+    parser.add_argument('directory')
+    parser.add_argument('--qpids', type=int, nargs='+', help='quadrature point ids (default: all)')
+    parser.add_argument('--replicas', type=int, nargs='+', help='replicas (default: all)')
+    args = parser.parse_args()
+
+    header_printed = False
+    for log_filename in sorted(glob.glob(args.directory + '/mddata.batch*.bin')):
+        with open(log_filename, 'rb') as log_file:
+            for qp_id, replica, time_id, offset in read_index(log_filename):
+                if args.qpids and qp_id not in args.qpids:
+                    continue
+                if args.replicas and replica not in args.replicas:
+                    continue
+                header, strain, samples = read_record(log_file, offset)
+                if not header_printed:
+                    components = component_names(len(strain))
+                    print(','.join(['qp_id', 'material_id', 'time_id', 'temperature', 'strain_rate',
+                                    'force_field', 'replica_id'] + ['strain_' + c for c in components]
+                                   + ['stress_' + c for c in components]))
+                    header_printed = True
+                for sample in samples:
+                    print(','.join(header + [repr(v) for v in strain] + [repr(v) for v in sample]))